@@ -29,7 +29,11 @@ apt-get update
 
 echo ""
 echo "Installing build tools..."
-apt-get install -y build-essential cmake git
+apt-get install -y build-essential cmake git pkg-config
+
+echo ""
+echo "Installing libfuse3 (optional, for 'pi4flasher mount')..."
+apt-get install -y libfuse3-dev fuse3 || echo "libfuse3 not available, building without FUSE support"
 
 echo ""
 echo "Checking for bcm2835 library..."
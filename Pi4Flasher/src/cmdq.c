@@ -0,0 +1,214 @@
+/*
+ * Pi4Flasher - Xbox 360 NAND Flasher for Raspberry Pi 4
+ * Copyright (c) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+#include "cmdq.h"
+#include "protocol.h"
+#include "serial.h"
+#include "nand_wb.h"
+#include "xbox.h"
+#include "dump_cache.h"
+#include "nand_edc.h"
+#include "log.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct cmdq_entry {
+    uint8_t tag;
+    uint8_t cmd;
+    uint32_t lba;
+    uint32_t len;
+    uint8_t payload[TAGGED_MAX_PAYLOAD];
+};
+
+static struct cmdq_entry queue[TAGGED_QUEUE_DEPTH];
+static uint32_t q_head;     /* next entry to run, engine thread */
+static uint32_t q_tail;     /* next free entry, command loop */
+
+static pthread_t engine_thread;
+static int engine_started;
+static pthread_mutex_t q_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t q_cond = PTHREAD_COND_INITIALIZER;
+static int q_stop;
+
+/* Reply body of a multi-sector read: status and sectors */
+static uint8_t read_reply[4 + TAGGED_MAX_READ * 0x210];
+
+void cmdq_reply(uint8_t tag, uint8_t cmd, const void *data, uint32_t len)
+{
+    struct tagged_reply hdr = { tag, cmd, 0, len };
+    uint8_t *buf = malloc(sizeof(hdr) + len);
+
+    if (!buf) {
+        LOG_ERROR("Tagged reply of %u bytes: out of memory", len);
+        return;
+    }
+    memcpy(buf, &hdr, sizeof(hdr));
+    memcpy(buf + sizeof(hdr), data, len);
+    serial_write(buf, sizeof(hdr) + len);
+    free(buf);
+}
+
+void cmdq_reply_status(uint8_t tag, uint8_t cmd, uint32_t status)
+{
+    cmdq_reply(tag, cmd, &status, 4);
+}
+
+static void engine_read(struct cmdq_entry *e)
+{
+    uint32_t count = 1;
+    uint32_t status = 0;
+
+    if (e->len >= 4)
+        memcpy(&count, e->payload, 4);
+    if (count == 0 || count > TAGGED_MAX_READ) {
+        cmdq_reply_status(e->tag, e->cmd, 0x8000);
+        return;
+    }
+
+    nand_wb_flush();
+    for (uint32_t i = 0; i < count && !status; i++) {
+        uint8_t *sector = &read_reply[4 + i * 0x210];
+        status = dump_cache_read(e->lba + i, sector, sector + 0x200);
+        if (status)
+            LOG_WARN("Tagged read block %u: ERROR 0x%X", e->lba + i, status);
+    }
+
+    memcpy(read_reply, &status, 4);
+    cmdq_reply(e->tag, e->cmd, read_reply, status ? 4 : 4 + count * 0x210);
+}
+
+static void engine_run(struct cmdq_entry *e)
+{
+    uint32_t ret;
+
+    switch (e->cmd) {
+        case READ_FLASH:
+            engine_read(e);
+            break;
+
+        case WRITE_FLASH:
+            if (e->len != 0x210) {
+                cmdq_reply_status(e->tag, e->cmd, 0x8000);
+                break;
+            }
+            ret = nand_wb_write(e->lba, e->payload, &e->payload[0x200]);
+            if (ret)
+                LOG_WARN("Tagged write block %u: ERROR 0x%X", e->lba, ret);
+            cmdq_reply_status(e->tag, e->cmd, ret);
+            break;
+
+        case WRITE_FLASH_DATA: {
+            uint8_t sector[0x210];
+            if (e->len != 0x200) {
+                cmdq_reply_status(e->tag, e->cmd, 0x8000);
+                break;
+            }
+            memcpy(sector, e->payload, 0x200);
+            nand_edc_make_sector(e->lba, sector);
+            ret = nand_wb_write(e->lba, sector, &sector[0x200]);
+            if (ret)
+                LOG_WARN("Tagged write block %u: ERROR 0x%X", e->lba, ret);
+            cmdq_reply_status(e->tag, e->cmd, ret);
+            break;
+        }
+
+        case SYNC_FLASH:
+            ret = nand_wb_sync();
+            if (ret)
+                LOG_WARN("Tagged sync: ERROR 0x%X", ret);
+            cmdq_reply_status(e->tag, e->cmd, ret);
+            break;
+
+        default:
+            cmdq_reply_status(e->tag, e->cmd, TAGGED_UNSUPPORTED);
+            break;
+    }
+}
+
+static void *engine_main(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&q_lock);
+    for (;;) {
+        while (q_head == q_tail && !q_stop)
+            pthread_cond_wait(&q_cond, &q_lock);
+        if (q_head == q_tail)
+            break;
+
+        /* The entry stays allocated until q_head moves past it */
+        struct cmdq_entry *e = &queue[q_head % TAGGED_QUEUE_DEPTH];
+        pthread_mutex_unlock(&q_lock);
+
+        engine_run(e);
+
+        pthread_mutex_lock(&q_lock);
+        q_head++;
+        pthread_cond_broadcast(&q_cond);
+    }
+    pthread_mutex_unlock(&q_lock);
+    return NULL;
+}
+
+int cmdq_init(void)
+{
+    if (pthread_create(&engine_thread, NULL, engine_main, NULL) != 0) {
+        LOG_ERROR("Failed to start command engine thread");
+        return -1;
+    }
+    engine_started = 1;
+    return 0;
+}
+
+void cmdq_deinit(void)
+{
+    if (!engine_started)
+        return;
+
+    pthread_mutex_lock(&q_lock);
+    q_stop = 1;
+    pthread_cond_broadcast(&q_cond);
+    pthread_mutex_unlock(&q_lock);
+    pthread_join(engine_thread, NULL);
+    engine_started = 0;
+}
+
+int cmdq_running(void)
+{
+    return engine_started;
+}
+
+int cmdq_submit(uint8_t tag, uint8_t cmd, uint32_t lba, const uint8_t *payload, uint32_t len)
+{
+    int ret = -1;
+
+    pthread_mutex_lock(&q_lock);
+    if (engine_started && q_tail - q_head < TAGGED_QUEUE_DEPTH) {
+        struct cmdq_entry *e = &queue[q_tail % TAGGED_QUEUE_DEPTH];
+        e->tag = tag;
+        e->cmd = cmd;
+        e->lba = lba;
+        e->len = len;
+        memcpy(e->payload, payload, len);
+        q_tail++;
+        pthread_cond_broadcast(&q_cond);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&q_lock);
+    return ret;
+}
+
+void cmdq_wait_idle(void)
+{
+    pthread_mutex_lock(&q_lock);
+    while (q_head != q_tail)
+        pthread_cond_wait(&q_cond, &q_lock);
+    pthread_mutex_unlock(&q_lock);
+}
@@ -0,0 +1,73 @@
+/*
+ * Pi4Flasher - Xbox 360 NAND Flasher for Raspberry Pi 4
+ * Copyright (c) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+#ifndef __CMDQ_H__
+#define __CMDQ_H__
+
+#include <stdint.h>
+
+/*
+ * Tagged command queue
+ *
+ * In tagged mode the command loop only parses commands. NAND commands are
+ * queued and run in order on the engine thread, while commands that need no
+ * NAND access are answered straight away, so their replies can overtake
+ * queued work. Every reply carries the tag of its command (protocol.h).
+ * While tagged mode is active the engine thread is the only caller of the
+ * NAND functions besides the write-back flush thread.
+ */
+
+/**
+ * Start the engine thread
+ * @return 0 on success, -1 on failure
+ */
+int cmdq_init(void);
+
+/**
+ * Finish queued commands and stop the engine thread
+ */
+void cmdq_deinit(void);
+
+/**
+ * Check whether the engine thread is running
+ * @return non-zero if tagged commands can be queued
+ */
+int cmdq_running(void);
+
+/**
+ * Queue a NAND command
+ * @param tag Host tag, echoed in the reply
+ * @param cmd READ_FLASH, WRITE_FLASH or SYNC_FLASH
+ * @param lba Command lba
+ * @param payload Command payload, copied
+ * @param len Payload length, at most TAGGED_MAX_PAYLOAD
+ * @return 0 if queued, -1 if the queue is full
+ */
+int cmdq_submit(uint8_t tag, uint8_t cmd, uint32_t lba, const uint8_t *payload, uint32_t len);
+
+/**
+ * Wait until every queued command has completed
+ */
+void cmdq_wait_idle(void);
+
+/**
+ * Send a tagged reply as one contiguous write
+ * @param tag Tag of the command
+ * @param cmd Command being answered
+ * @param data Reply body, the same bytes the untagged command would send
+ * @param len Length of the reply body
+ */
+void cmdq_reply(uint8_t tag, uint8_t cmd, const void *data, uint32_t len);
+
+/**
+ * Send a tagged reply holding only a uint32 status
+ */
+void cmdq_reply_status(uint8_t tag, uint8_t cmd, uint32_t status);
+
+#endif /* __CMDQ_H__ */
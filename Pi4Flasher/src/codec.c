@@ -0,0 +1,190 @@
+/*
+ * Pi4Flasher - Xbox 360 NAND Flasher for Raspberry Pi 4
+ * Copyright (c) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+#include "codec.h"
+#include "protocol.h"
+#include <string.h>
+
+/* RLE: control byte < 0x80 is a literal run, >= 0x80 a repeated byte */
+#define RLE_MAX_LITERALS 0x80
+#define RLE_MIN_RUN 3
+#define RLE_MAX_RUN (0x7F + RLE_MIN_RUN)
+
+/* LZ4 block format limits */
+#define LZ4_HASH_BITS 12
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5     /* last bytes are always literals */
+#define LZ4_MF_LIMIT 12         /* last match starts before this */
+#define LZ4_MAX_OFFSET 0xFFFF
+
+uint32_t codec_select(uint32_t mask)
+{
+    if (mask & (1u << STREAM_CODEC_LZ4))
+        return STREAM_CODEC_LZ4;
+    if (mask & (1u << STREAM_CODEC_RLE))
+        return STREAM_CODEC_RLE;
+    return STREAM_CODEC_NONE;
+}
+
+static size_t rle_literals(const uint8_t *src, size_t n, uint8_t *dst,
+                           size_t o, size_t cap)
+{
+    while (n) {
+        size_t chunk = n < RLE_MAX_LITERALS ? n : RLE_MAX_LITERALS;
+        if (o + 1 + chunk > cap)
+            return 0;
+        dst[o++] = chunk - 1;
+        memcpy(&dst[o], src, chunk);
+        o += chunk;
+        src += chunk;
+        n -= chunk;
+    }
+    return o;
+}
+
+static size_t rle_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap)
+{
+    size_t i = 0, o = 0, lit = 0;
+
+    while (i < len) {
+        size_t run = 1;
+        while (i + run < len && run < RLE_MAX_RUN && src[i + run] == src[i])
+            run++;
+
+        if (run < RLE_MIN_RUN) {
+            i += run;
+            continue;
+        }
+
+        if (i > lit) {
+            o = rle_literals(&src[lit], i - lit, dst, o, cap);
+            if (!o)
+                return 0;
+        }
+        if (o + 2 > cap)
+            return 0;
+        dst[o++] = 0x80 | (run - RLE_MIN_RUN);
+        dst[o++] = src[i];
+        i += run;
+        lit = i;
+    }
+
+    if (len > lit)
+        o = rle_literals(&src[lit], len - lit, dst, o, cap);
+    return o;
+}
+
+static uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static uint32_t lz4_hash(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+/* Length continuation bytes for a nibble that saturated at 15 */
+static uint8_t *lz4_put_length(uint8_t *op, size_t len)
+{
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+/* Token, literal run and, when mlen is not 0, offset and match length */
+static uint8_t *lz4_sequence(uint8_t *op, const uint8_t *lit, size_t nlit,
+                             uint16_t offset, size_t mlen)
+{
+    uint8_t *token = op++;
+
+    *token = (nlit >= 15 ? 15 : nlit) << 4;
+    if (nlit >= 15)
+        op = lz4_put_length(op, nlit - 15);
+    memcpy(op, lit, nlit);
+    op += nlit;
+
+    if (mlen) {
+        mlen -= LZ4_MIN_MATCH;
+        *op++ = offset & 0xFF;
+        *op++ = offset >> 8;
+        *token |= mlen >= 15 ? 15 : mlen;
+        if (mlen >= 15)
+            op = lz4_put_length(op, mlen - 15);
+    }
+    return op;
+}
+
+/* Greedy single-probe LZ4 block encoder */
+static size_t lz4_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap)
+{
+    uint32_t table[1 << LZ4_HASH_BITS];
+    const uint8_t *ip = src, *anchor = src;
+    const uint8_t *end = src + len;
+    uint8_t *op = dst;
+
+    memset(table, 0, sizeof(table));
+
+    while (len > LZ4_MF_LIMIT && ip <= end - LZ4_MF_LIMIT) {
+        uint32_t seq = read32(ip);
+        uint32_t h = lz4_hash(seq);
+        const uint8_t *ref = src + table[h];
+        table[h] = ip - src;
+
+        if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || read32(ref) != seq) {
+            ip++;
+            continue;
+        }
+
+        while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+            ip--;
+            ref--;
+        }
+
+        const uint8_t *mp = ip + LZ4_MIN_MATCH;
+        const uint8_t *rp = ref + LZ4_MIN_MATCH;
+        while (mp < end - LZ4_LAST_LITERALS && *mp == *rp) {
+            mp++;
+            rp++;
+        }
+
+        size_t nlit = ip - anchor;
+        size_t mlen = mp - ip;
+        if ((size_t)(op - dst) + 1 + nlit + nlit / 255 + 3 + mlen / 255 > cap)
+            return 0;
+        op = lz4_sequence(op, anchor, nlit, ip - ref, mlen);
+
+        ip = mp;
+        anchor = ip;
+    }
+
+    size_t nlit = end - anchor;
+    if ((size_t)(op - dst) + 1 + nlit + nlit / 255 + 1 > cap)
+        return 0;
+    op = lz4_sequence(op, anchor, nlit, 0, 0);
+    return op - dst;
+}
+
+size_t codec_compress(uint32_t codec, const uint8_t *src, size_t len,
+                      uint8_t *dst, size_t cap)
+{
+    switch (codec) {
+        case STREAM_CODEC_RLE:
+            return rle_compress(src, len, dst, cap);
+        case STREAM_CODEC_LZ4:
+            return lz4_compress(src, len, dst, cap);
+        default:
+            return 0;
+    }
+}
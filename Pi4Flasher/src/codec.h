@@ -0,0 +1,45 @@
+/*
+ * Pi4Flasher - Xbox 360 NAND Flasher for Raspberry Pi 4
+ * Copyright (c) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+#ifndef __CODEC_H__
+#define __CODEC_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Stream compression codecs
+ *
+ * Both encoders are single-pass and need no allocation, so a batch of
+ * sectors can be compressed on a worker thread while the next batch is read
+ * from the NAND. Codec ids and the RLE format are defined in protocol.h;
+ * STREAM_CODEC_LZ4 produces a standard LZ4 block (no frame header).
+ */
+
+/**
+ * Pick the codec to use from the set the host can decode
+ * @param mask Bit (1 << STREAM_CODEC_*) set for every codec the host supports
+ * @return Best supported STREAM_CODEC_* id, STREAM_CODEC_NONE if none match
+ */
+uint32_t codec_select(uint32_t mask);
+
+/**
+ * Compress a buffer
+ * @param codec STREAM_CODEC_* id
+ * @param src Input bytes
+ * @param len Number of input bytes
+ * @param dst Output buffer
+ * @param cap Size of the output buffer
+ * @return Compressed length, 0 if the output did not fit or the codec is
+ *         STREAM_CODEC_NONE
+ */
+size_t codec_compress(uint32_t codec, const uint8_t *src, size_t len,
+                      uint8_t *dst, size_t cap);
+
+#endif /* __CODEC_H__ */
@@ -0,0 +1,42 @@
+/*
+ * Pi4Flasher - Xbox 360 NAND Flasher for Raspberry Pi 4
+ * Copyright (c) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+#include "dedup.h"
+#include <stdlib.h>
+
+/* Sorted, so a lookup is a binary search */
+static uint64_t *known;
+static uint32_t known_count;
+
+static int hash_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+void dedup_set(uint64_t *hashes, uint32_t count)
+{
+    free(known);
+    known = hashes;
+    known_count = hashes ? count : 0;
+    if (known_count)
+        qsort(known, known_count, sizeof(*known), hash_cmp);
+}
+
+uint32_t dedup_count(void)
+{
+    return known_count;
+}
+
+int dedup_contains(uint64_t hash)
+{
+    return known_count &&
+           bsearch(&hash, known, known_count, sizeof(*known), hash_cmp) != NULL;
+}
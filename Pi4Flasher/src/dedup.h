@@ -0,0 +1,45 @@
+/*
+ * Pi4Flasher - Xbox 360 NAND Flasher for Raspberry Pi 4
+ * Copyright (c) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+#ifndef __DEDUP_H__
+#define __DEDUP_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Known sector set for deduplicated streams
+ *
+ * The host preloads XXH64 hashes of sectors it already has (512 data bytes
+ * followed by the 16 spare bytes, as in a raw image). Streams with
+ * STREAM_FLAG_DEDUP send only the hash for sectors found in the set.
+ */
+
+/**
+ * Replace the known sector set
+ * @param hashes Array of XXH64 sector hashes, ownership passes to the set
+ *               (NULL to clear)
+ * @param count Number of hashes
+ */
+void dedup_set(uint64_t *hashes, uint32_t count);
+
+/**
+ * Get the number of hashes in the known sector set
+ * @return Number of hashes
+ */
+uint32_t dedup_count(void);
+
+/**
+ * Look up a sector hash
+ * @param hash XXH64 of the sector's 0x210 bytes
+ * @return non-zero if the host has the sector
+ */
+int dedup_contains(uint64_t hash);
+
+#endif /* __DEDUP_H__ */
@@ -0,0 +1,369 @@
+/*
+ * Pi4Flasher - Xbox 360 NAND Flasher for Raspberry Pi 4
+ * Copyright (c) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+#include "dump_cache.h"
+#include "nand_layout.h"
+#include "nand_hash.h"
+#include "hash.h"
+#include "xbox.h"
+#include "log.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SECTOR_SIZE 0x210
+#define CACHE_MAGIC 0x43443450  /* "P4DC" */
+#define CACHE_VERSION 1
+
+/* Start of the index file */
+struct cache_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flash_config;
+    uint32_t sectors_per_block;
+    uint64_t fingerprint;
+    uint32_t blocks;
+    uint32_t reserved;
+};
+
+/* One per erase block, after the header */
+struct cache_entry {
+    uint64_t hash;          /* XXH64 of the cached block */
+    uint32_t complete;      /* every sector of the block is cached */
+    uint32_t reserved;
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *cache_dir;
+static int cache_enabled;
+static int cache_attached;
+
+/* Sector bitmaps: current in the image this session, written before the
+ * cache was attached */
+static uint8_t cache_have[DUMP_CACHE_MAX_SECTORS / 8];
+static uint8_t cache_dirty[DUMP_CACHE_MAX_SECTORS / 8];
+
+static uint32_t cache_spb;
+static uint32_t cache_blocks;
+static uint8_t *cache_checked;          /* per block, validated this session */
+static uint8_t *cache_image;
+static size_t cache_image_size;
+static struct cache_header *cache_hdr;
+static struct cache_entry *cache_index;
+static size_t cache_index_size;
+static int cache_image_fd = -1;
+static int cache_index_fd = -1;
+
+/* Statistics */
+static uint32_t cache_served;
+static uint32_t cache_validated;
+static uint32_t cache_dropped;
+
+static int bit_test(const uint8_t *map, uint32_t i)
+{
+    return map[i / 8] & (1 << (i % 8));
+}
+
+static void bit_set(uint8_t *map, uint32_t i)
+{
+    map[i / 8] |= 1 << (i % 8);
+}
+
+static void bit_clear(uint8_t *map, uint32_t i)
+{
+    map[i / 8] &= ~(1 << (i % 8));
+}
+
+/**
+ * Fingerprint the console: XXH64 over the hashes of the header and keyvault
+ * sectors, or of sector 0 when it holds no NAND header
+ * @return 0 on success, NAND error code on failure
+ */
+static int cache_fingerprint(uint64_t *fingerprint)
+{
+    struct essential_region regions[NAND_LAYOUT_MAX_REGIONS];
+    struct xxh64_state state;
+    uint32_t count = 0;
+    uint64_t hash;
+
+    int ret = nand_layout_essentials(regions, &count);
+    if (ret > 0)
+        return ret;
+    if (ret < 0) {
+        regions[0].type = ESSENTIAL_HEADER;
+        regions[0].offset = 0;
+        regions[0].length = 0x200;
+        count = 1;
+    }
+
+    xxh64_init(&state);
+    for (uint32_t i = 0; i < count; i++) {
+        if (regions[i].type != ESSENTIAL_HEADER && regions[i].type != ESSENTIAL_KEYVAULT)
+            continue;
+        ret = nand_hash_sectors(regions[i].offset / 0x200,
+                                (regions[i].length + 0x1FF) / 0x200, &hash);
+        if (ret)
+            return ret;
+        xxh64_update(&state, &hash, sizeof(hash));
+    }
+    *fingerprint = xxh64_digest(&state);
+    return 0;
+}
+
+/* Open or create a cache file of the given size and map it */
+static void *cache_map(const char *name, size_t size, int *fd, int *created)
+{
+    struct stat st;
+
+    *fd = open(name, O_RDWR | O_CREAT, 0644);
+    if (*fd < 0 || fstat(*fd, &st) != 0) {
+        LOG_ERROR("Cache: cannot open %s: %s", name, strerror(errno));
+        return NULL;
+    }
+
+    *created = (size_t)st.st_size != size;
+    if (*created && (ftruncate(*fd, 0) != 0 || ftruncate(*fd, size) != 0)) {
+        LOG_ERROR("Cache: cannot size %s: %s", name, strerror(errno));
+        return NULL;
+    }
+
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+    if (p == MAP_FAILED) {
+        LOG_ERROR("Cache: cannot map %s: %s", name, strerror(errno));
+        return NULL;
+    }
+    return p;
+}
+
+static void cache_unmap(void)
+{
+    if (cache_image) {
+        msync(cache_image, cache_image_size, MS_SYNC);
+        munmap(cache_image, cache_image_size);
+    }
+    if (cache_hdr) {
+        msync(cache_hdr, cache_index_size, MS_SYNC);
+        munmap(cache_hdr, cache_index_size);
+    }
+    if (cache_image_fd >= 0)
+        close(cache_image_fd);
+    if (cache_index_fd >= 0)
+        close(cache_index_fd);
+    free(cache_checked);
+
+    cache_image = NULL;
+    cache_hdr = NULL;
+    cache_index = NULL;
+    cache_checked = NULL;
+    cache_image_fd = cache_index_fd = -1;
+    cache_attached = 0;
+}
+
+/* Identify the console and map its cache files, called with cache_lock held */
+static int cache_attach(void)
+{
+    uint32_t flash_config = xbox_get_flash_config();
+    uint64_t fingerprint;
+    char name[4096];
+    int created;
+
+    int ret = cache_fingerprint(&fingerprint);
+    if (ret) {
+        LOG_WARN("Cache: cannot read the console identity: 0x%X", ret);
+        return -1;
+    }
+
+    cache_spb = xbox_nand_get_geometry()->sectors_per_block;
+    cache_blocks = DUMP_CACHE_MAX_SECTORS / cache_spb;
+    cache_checked = calloc(cache_blocks, 1);
+    if (!cache_checked)
+        return -1;
+
+    cache_index_size = sizeof(struct cache_header) + cache_blocks * sizeof(struct cache_entry);
+    snprintf(name, sizeof(name), "%s/%08x-%016llx.idx", cache_dir, flash_config,
+             (unsigned long long)fingerprint);
+    cache_hdr = cache_map(name, cache_index_size, &cache_index_fd, &created);
+    if (!cache_hdr)
+        goto fail;
+    cache_index = (struct cache_entry *)(cache_hdr + 1);
+
+    if (created || cache_hdr->magic != CACHE_MAGIC || cache_hdr->version != CACHE_VERSION ||
+        cache_hdr->flash_config != flash_config || cache_hdr->fingerprint != fingerprint ||
+        cache_hdr->sectors_per_block != cache_spb || cache_hdr->blocks != cache_blocks) {
+        memset(cache_hdr, 0, cache_index_size);
+        cache_hdr->magic = CACHE_MAGIC;
+        cache_hdr->version = CACHE_VERSION;
+        cache_hdr->flash_config = flash_config;
+        cache_hdr->sectors_per_block = cache_spb;
+        cache_hdr->fingerprint = fingerprint;
+        cache_hdr->blocks = cache_blocks;
+    }
+
+    cache_image_size = (size_t)DUMP_CACHE_MAX_SECTORS * SECTOR_SIZE;
+    snprintf(name, sizeof(name), "%s/%08x-%016llx.img", cache_dir, flash_config,
+             (unsigned long long)fingerprint);
+    cache_image = cache_map(name, cache_image_size, &cache_image_fd, &created);
+    if (!cache_image)
+        goto fail;
+    if (created)
+        memset(cache_index, 0, cache_blocks * sizeof(struct cache_entry));
+
+    /* Apply writes that happened before the identity was known */
+    uint32_t complete = 0;
+    for (uint32_t b = 0; b < cache_blocks; b++) {
+        for (uint32_t s = b * cache_spb; s < (b + 1) * cache_spb; s++) {
+            if (bit_test(cache_dirty, s)) {
+                cache_index[b].complete = 0;
+                break;
+            }
+        }
+        complete += cache_index[b].complete != 0;
+    }
+    memset(cache_dirty, 0, sizeof(cache_dirty));
+
+    cache_attached = 1;
+    LOG_INFO("Cache: console %08x-%016llx, %u of %u erase blocks cached",
+             flash_config, (unsigned long long)fingerprint, complete, cache_blocks);
+    return 0;
+
+fail:
+    cache_unmap();
+    return -1;
+}
+
+/* Compare a complete block's spare areas with the NAND, called with cache_lock held */
+static void cache_validate(uint32_t block)
+{
+    uint32_t start = block * cache_spb;
+    uint8_t *data = &cache_image[(size_t)start * SECTOR_SIZE];
+    int valid = xxh64(data, (size_t)cache_spb * SECTOR_SIZE) == cache_index[block].hash;
+
+    for (uint32_t i = 0; valid && i < cache_spb; i++) {
+        uint8_t spare[0x10];
+        valid = xbox_nand_read_spare(start + i, spare) == 0 &&
+                memcmp(spare, &data[i * SECTOR_SIZE + 0x200], sizeof(spare)) == 0;
+    }
+
+    if (!valid) {
+        cache_index[block].complete = 0;
+        cache_dropped++;
+        LOG_DEBUG("Cache: erase block %u changed, dropped", block);
+        return;
+    }
+    for (uint32_t i = 0; i < cache_spb; i++)
+        bit_set(cache_have, start + i);
+    cache_validated++;
+}
+
+/* Keep a sector read from the NAND, called with cache_lock held */
+static void cache_store(uint32_t lba, const uint8_t *buffer, const uint8_t *spare)
+{
+    uint32_t block = lba / cache_spb;
+    uint32_t start = block * cache_spb;
+    uint8_t *sector = &cache_image[(size_t)lba * SECTOR_SIZE];
+
+    memcpy(sector, buffer, 0x200);
+    memcpy(sector + 0x200, spare, 0x10);
+    bit_set(cache_have, lba);
+
+    for (uint32_t i = start; i < start + cache_spb; i++) {
+        if (!bit_test(cache_have, i))
+            return;
+    }
+    cache_index[block].hash = xxh64(&cache_image[(size_t)start * SECTOR_SIZE],
+                                    (size_t)cache_spb * SECTOR_SIZE);
+    cache_index[block].complete = 1;
+}
+
+int dump_cache_enable(const char *dir)
+{
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        LOG_ERROR("Cache: cannot create %s: %s", dir, strerror(errno));
+        return -1;
+    }
+    cache_dir = strdup(dir);
+    if (!cache_dir)
+        return -1;
+    cache_enabled = 1;
+    return 0;
+}
+
+void dump_cache_close(void)
+{
+    pthread_mutex_lock(&cache_lock);
+    cache_unmap();
+    cache_enabled = 0;
+    free(cache_dir);
+    cache_dir = NULL;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+int dump_cache_read(uint32_t lba, uint8_t *buffer, uint8_t *spare)
+{
+    pthread_mutex_lock(&cache_lock);
+
+    if (cache_enabled && !cache_attached && cache_attach() != 0) {
+        LOG_WARN("Cache: disabled for this session");
+        cache_enabled = 0;
+    }
+    if (!cache_enabled || lba >= DUMP_CACHE_MAX_SECTORS) {
+        pthread_mutex_unlock(&cache_lock);
+        return xbox_nand_read_block(lba, buffer, spare);
+    }
+
+    uint32_t block = lba / cache_spb;
+    if (!cache_checked[block]) {
+        cache_checked[block] = 1;
+        if (cache_index[block].complete)
+            cache_validate(block);
+    }
+
+    int ret = 0;
+    if (bit_test(cache_have, lba)) {
+        const uint8_t *sector = &cache_image[(size_t)lba * SECTOR_SIZE];
+        memcpy(buffer, sector, 0x200);
+        memcpy(spare, sector + 0x200, 0x10);
+        cache_served++;
+    } else {
+        ret = xbox_nand_read_block(lba, buffer, spare);
+        if (ret == 0)
+            cache_store(lba, buffer, spare);
+    }
+
+    pthread_mutex_unlock(&cache_lock);
+    return ret;
+}
+
+void dump_cache_invalidate(uint32_t lba)
+{
+    if (lba >= DUMP_CACHE_MAX_SECTORS)
+        return;
+
+    pthread_mutex_lock(&cache_lock);
+    if (cache_attached) {
+        bit_clear(cache_have, lba);
+        cache_index[lba / cache_spb].complete = 0;
+    } else if (cache_enabled) {
+        bit_set(cache_dirty, lba);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void dump_cache_report(void)
+{
+    if (cache_served || cache_validated || cache_dropped)
+        LOG_INFO("Cache: %u sectors served, %u erase blocks validated, %u changed",
+                 cache_served, cache_validated, cache_dropped);
+}
@@ -0,0 +1,74 @@
+/*
+ * Pi4Flasher - Xbox 360 NAND Flasher for Raspberry Pi 4
+ * Copyright (c) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+#ifndef __DUMP_CACHE_H__
+#define __DUMP_CACHE_H__
+
+#include <stdint.h>
+
+/*
+ * Persistent dump cache
+ *
+ * Sectors read from the NAND are kept in an image file on the Pi, one per
+ * console. A console is identified by its flash configuration and an XXH64
+ * fingerprint of the NAND header and keyvault sectors. Once every sector of
+ * an erase block has been read, the block is marked complete in an index
+ * file along with its XXH64 block hash (see nand_hash.h).
+ *
+ * The first read of a complete block in a session validates it: only the
+ * spare areas are read from the NAND and compared with the cached ones, and
+ * the cached data is checked against the block hash. Spare areas carry the
+ * ECC of their page, so a rewritten page practically always changes its
+ * spare. If everything matches, the block's sectors are served from the
+ * file; otherwise the block is dropped and read from the NAND again.
+ *
+ * Every nand_wb_write() invalidates the sector it writes. The first
+ * dump_cache_read() attaches the cache, which reads the identity sectors,
+ * so callers must have flushed the write-back buffer as for any read.
+ */
+
+/* Sectors covered by the cache, the 64 MB system area of big block NANDs */
+#define DUMP_CACHE_MAX_SECTORS 0x20000
+
+/**
+ * Enable the cache for this session
+ * @param dir Directory holding the cache files, created if missing
+ * @return 0 on success, -1 on failure
+ */
+int dump_cache_enable(const char *dir);
+
+/**
+ * Write back and close the cache files
+ */
+void dump_cache_close(void);
+
+/**
+ * Read a sector through the cache
+ * Same contract as xbox_nand_read_block(), which is used directly while the
+ * cache is disabled.
+ * @param lba Logical block address (512-byte sector)
+ * @param buffer Receives 512 bytes of data
+ * @param spare Receives 16 bytes of spare data
+ * @return 0 on success, NAND error code on failure
+ */
+int dump_cache_read(uint32_t lba, uint8_t *buffer, uint8_t *spare);
+
+/**
+ * Drop a sector that is about to be rewritten
+ * Safe from any thread.
+ * @param lba Logical block address
+ */
+void dump_cache_invalidate(uint32_t lba);
+
+/**
+ * Log sectors served from the cache and blocks validated or dropped
+ */
+void dump_cache_report(void);
+
+#endif /* __DUMP_CACHE_H__ */
@@ -0,0 +1,76 @@
+/*
+ * Pi4Flasher - Xbox 360 NAND Flasher for Raspberry Pi 4
+ * Copyright (c) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+#ifndef __HASH_H__
+#define __HASH_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Streaming XXH64 state (seed 0), used for erase block hashes */
+struct xxh64_state {
+    uint64_t v[4];
+    uint64_t total_len;
+    uint8_t mem[32];
+    uint32_t mem_size;
+};
+
+/**
+ * Reset an XXH64 state
+ * @param state State to initialize
+ */
+void xxh64_init(struct xxh64_state *state);
+
+/**
+ * Feed data into an XXH64 state
+ * @param state Initialized state
+ * @param data Input bytes
+ * @param len Number of input bytes
+ */
+void xxh64_update(struct xxh64_state *state, const void *data, size_t len);
+
+/**
+ * Finish an XXH64 computation
+ * @param state State fed with all input
+ * @return 64-bit hash
+ */
+uint64_t xxh64_digest(const struct xxh64_state *state);
+
+/**
+ * Hash a buffer in one call
+ * @param data Input bytes
+ * @param len Number of input bytes
+ * @return 64-bit hash
+ */
+uint64_t xxh64(const void *data, size_t len);
+
+/**
+ * Continue a CRC32C (Castagnoli) computation
+ * @param crc CRC of the preceding data, 0 to start
+ * @param data Input bytes
+ * @param len Number of input bytes
+ * @return Updated CRC
+ */
+uint32_t crc32c_update(uint32_t crc, const void *data, size_t len);
+
+/**
+ * CRC32C (Castagnoli) of a buffer, used for frame checksums
+ * @param data Input bytes
+ * @param len Number of input bytes
+ * @return 32-bit CRC
+ */
+uint32_t crc32c(const void *data, size_t len);
+
+/**
+ * Check whether crc32c() uses the ARMv8 CRC32 instructions
+ * @return non-zero when built for the CRC extension
+ */
+int crc32c_hw(void);
+
+#endif /* __HASH_H__ */
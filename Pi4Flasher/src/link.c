@@ -0,0 +1,405 @@
+/*
+ * Pi4Flasher - Xbox 360 NAND Flasher for Raspberry Pi 4
+ * Copyright (c) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+#include "link.h"
+#include "protocol.h"
+#include "hash.h"
+#include "log.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+
+#define LINK_HEADER_SIZE 4
+#define LINK_FRAME_MAX (LINK_HEADER_SIZE + LINK_MAX_PAYLOAD + 4)
+#define LINK_ENCODED_MAX (LINK_FRAME_MAX + LINK_FRAME_MAX / 254 + 2)
+
+/* Read timeouts (0.5 s each) tolerated in the middle of a command */
+#define LINK_READ_RETRIES 8
+
+struct link_frame {
+    uint16_t len;               /* header, payload and CRC */
+    uint8_t data[LINK_FRAME_MAX];
+};
+
+static int link_fd = -1;
+static atomic_int link_on;
+
+/* Transmit side, shared by all writers */
+static pthread_mutex_t tx_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct link_frame tx_history[LINK_HISTORY];
+static uint16_t tx_seq;
+static uint8_t tx_encoded[LINK_ENCODED_MAX];
+
+/* Receive side, command loop only */
+static uint8_t rx_raw[512];
+static size_t rx_raw_pos, rx_raw_len;
+static uint8_t rx_encoded[LINK_ENCODED_MAX];
+static size_t rx_encoded_len;
+static int rx_overflow;
+static int rx_idle;             /* last read timed out with nothing */
+static uint16_t rx_expected;
+static struct link_frame rx_early[LINK_RX_WINDOW];
+static uint8_t rx_data[(LINK_RX_WINDOW + 1) * LINK_MAX_PAYLOAD];
+static size_t rx_pos, rx_len;
+
+/* Statistics */
+static uint32_t link_retransmits;
+static uint32_t link_rx_bad;
+static uint32_t link_rx_gaps;
+
+static size_t cobs_encode(const uint8_t *src, size_t len, uint8_t *dst)
+{
+    size_t code_pos = 0, o = 1;
+    uint8_t code = 1;
+
+    for (size_t i = 0; i < len; i++) {
+        if (src[i] == 0) {
+            dst[code_pos] = code;
+            code_pos = o++;
+            code = 1;
+            continue;
+        }
+        dst[o++] = src[i];
+        if (++code == 0xFF) {
+            dst[code_pos] = code;
+            code_pos = o++;
+            code = 1;
+        }
+    }
+    dst[code_pos] = code;
+    return o;
+}
+
+/* Returns decoded length, 0 on a malformed frame */
+static size_t cobs_decode(const uint8_t *src, size_t len, uint8_t *dst, size_t cap)
+{
+    size_t i = 0, o = 0;
+
+    while (i < len) {
+        uint8_t code = src[i++];
+        if (!code || i + code - 1 > len || o + code > cap + 1)
+            return 0;
+        for (uint8_t j = 1; j < code; j++)
+            dst[o++] = src[i++];
+        if (code < 0xFF && i < len) {
+            if (o >= cap)
+                return 0;
+            dst[o++] = 0;
+        }
+    }
+    return o;
+}
+
+static int raw_write(const uint8_t *buffer, size_t len)
+{
+    size_t total = 0;
+    while (total < len) {
+        ssize_t n = write(link_fd, buffer + total, len - total);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            LOG_ERROR("Serial write error: %s", strerror(errno));
+            return -1;
+        }
+        total += n;
+    }
+    return 0;
+}
+
+/* Called with tx_lock held; nothing framed follows the CLOSE reply */
+static int send_frame(const struct link_frame *f)
+{
+    if (!atomic_load(&link_on))
+        return 0;
+
+    size_t n = cobs_encode(f->data, f->len, tx_encoded);
+    tx_encoded[n++] = 0;
+    return raw_write(tx_encoded, n);
+}
+
+static void build_frame(struct link_frame *f, uint8_t type, uint16_t seq,
+                        const uint8_t *payload, size_t len)
+{
+    f->data[0] = type;
+    f->data[1] = 0;
+    f->data[2] = seq & 0xFF;
+    f->data[3] = seq >> 8;
+    memcpy(&f->data[LINK_HEADER_SIZE], payload, len);
+
+    uint32_t crc = crc32c(f->data, LINK_HEADER_SIZE + len);
+    memcpy(&f->data[LINK_HEADER_SIZE + len], &crc, 4);
+    f->len = LINK_HEADER_SIZE + len + 4;
+}
+
+/* Control frames are not numbered and not kept for retransmission */
+static void send_control(uint8_t type, uint16_t seq)
+{
+    struct link_frame f;
+
+    build_frame(&f, type, seq, NULL, 0);
+    pthread_mutex_lock(&tx_lock);
+    send_frame(&f);
+    pthread_mutex_unlock(&tx_lock);
+}
+
+static void retransmit(uint16_t seq)
+{
+    pthread_mutex_lock(&tx_lock);
+    uint16_t age = tx_seq - seq;
+    if (age >= 1 && age <= LINK_HISTORY) {
+        send_frame(&tx_history[seq % LINK_HISTORY]);
+        link_retransmits++;
+    } else if (seq != tx_seq) {
+        LOG_WARN("Link: NAK for frame %u outside history", seq);
+    }
+    pthread_mutex_unlock(&tx_lock);
+}
+
+static uint16_t frame_seq(const struct link_frame *f)
+{
+    return f->data[2] | f->data[3] << 8;
+}
+
+static void deliver(const struct link_frame *f)
+{
+    size_t len = f->len - LINK_HEADER_SIZE - 4;
+    memcpy(&rx_data[rx_len], &f->data[LINK_HEADER_SIZE], len);
+    rx_len += len;
+    rx_expected++;
+}
+
+/* NAK every missing frame before seq that is not already held */
+static void request_missing(uint16_t seq)
+{
+    for (uint16_t s = rx_expected; s != seq; s++) {
+        if (rx_early[s % LINK_RX_WINDOW].len == 0)
+            send_control(LINK_FRAME_NAK, s);
+    }
+}
+
+static void handle_frame(struct link_frame *f)
+{
+    uint32_t crc;
+    memcpy(&crc, &f->data[f->len - 4], 4);
+    if (crc32c(f->data, f->len - 4) != crc) {
+        /* Cannot trust the sequence number, ask for the next expected one */
+        link_rx_bad++;
+        send_control(LINK_FRAME_NAK, rx_expected);
+        return;
+    }
+
+    uint8_t type = f->data[0];
+    uint16_t seq = frame_seq(f);
+
+    switch (type) {
+        case LINK_FRAME_NAK:
+            retransmit(seq);
+            return;
+
+        case LINK_FRAME_CLOSE:
+            atomic_store(&link_on, 0);
+            /* The stream worker may be inside link_write() */
+            pthread_mutex_lock(&tx_lock);
+            raw_write((const uint8_t *)"\0\0\0\0", 4);
+            pthread_mutex_unlock(&tx_lock);
+            LOG_INFO("Link: framed mode closed by host");
+            return;
+
+        case LINK_FRAME_DATA:
+            break;
+
+        default:
+            return;
+    }
+
+    uint16_t ahead = seq - rx_expected;
+    if (ahead >= 0x8000)
+        return;     /* duplicate of a delivered frame */
+
+    if (ahead == 0) {
+        deliver(f);
+        /* Frames that arrived early may now be in order */
+        struct link_frame *next;
+        while ((next = &rx_early[rx_expected % LINK_RX_WINDOW])->len &&
+               frame_seq(next) == rx_expected) {
+            deliver(next);
+            next->len = 0;
+        }
+        return;
+    }
+
+    if (ahead >= LINK_RX_WINDOW) {
+        request_missing(rx_expected + 1);
+        return;
+    }
+
+    link_rx_gaps++;
+    request_missing(seq);
+    rx_early[seq % LINK_RX_WINDOW] = *f;
+}
+
+/**
+ * Read frames until payload bytes are available
+ * Returns early instead of waiting when only control frames were pending, so
+ * a NAK arriving during a stream does not stall the command loop.
+ * @return 1 when rx_data has bytes, 0 on timeout, after control frames only
+ *         or when framed mode ends, -1 on error
+ */
+static int link_fill(void)
+{
+    struct link_frame frame;
+    int handled = 0;
+
+    rx_idle = 0;
+    while (rx_pos == rx_len && atomic_load(&link_on)) {
+        if (rx_raw_pos == rx_raw_len) {
+            if (handled && rx_encoded_len == 0)
+                return 0;
+            ssize_t n = read(link_fd, rx_raw, sizeof(rx_raw));
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                LOG_ERROR("Serial read error: %s", strerror(errno));
+                return -1;
+            }
+            if (n == 0) {
+                rx_idle = 1;
+                return 0;
+            }
+            rx_raw_pos = 0;
+            rx_raw_len = n;
+        }
+
+        uint8_t b = rx_raw[rx_raw_pos++];
+        if (b != 0) {
+            if (rx_encoded_len < sizeof(rx_encoded))
+                rx_encoded[rx_encoded_len++] = b;
+            else
+                rx_overflow = 1;
+            continue;
+        }
+
+        /* Delimiter: decode the frame collected so far */
+        if (rx_encoded_len) {
+            frame.len = rx_overflow ? 0 :
+                cobs_decode(rx_encoded, rx_encoded_len, frame.data, sizeof(frame.data));
+            if (frame.len < LINK_HEADER_SIZE + 4) {
+                link_rx_bad++;
+                send_control(LINK_FRAME_NAK, rx_expected);
+            } else {
+                if (rx_pos == rx_len)
+                    rx_pos = rx_len = 0;
+                handle_frame(&frame);
+            }
+            handled = 1;
+        }
+        rx_encoded_len = 0;
+        rx_overflow = 0;
+    }
+    return rx_pos < rx_len;
+}
+
+void link_start(int fd)
+{
+    pthread_mutex_lock(&tx_lock);
+    link_fd = fd;
+    tx_seq = 0;
+    pthread_mutex_unlock(&tx_lock);
+
+    rx_raw_pos = rx_raw_len = 0;
+    rx_encoded_len = 0;
+    rx_overflow = 0;
+    rx_expected = 0;
+    rx_pos = rx_len = 0;
+    memset(rx_early, 0, sizeof(rx_early));
+    atomic_store(&link_on, 1);
+}
+
+int link_active(void)
+{
+    return atomic_load(&link_on);
+}
+
+int link_pending(void)
+{
+    return rx_pos < rx_len || rx_raw_pos < rx_raw_len;
+}
+
+int link_read_exact(uint8_t *buffer, size_t len)
+{
+    size_t total = 0;
+    int retries = 0;
+
+    while (total < len) {
+        if (rx_pos == rx_len) {
+            int ret = link_fill();
+            if (ret < 0)
+                return -1;
+            if (ret == 0) {
+                /* Timeout, or the host left framed mode */
+                if (total == 0 || !atomic_load(&link_on))
+                    return total ? -1 : 0;
+                if (!rx_idle)
+                    continue;
+                /* The frame with the rest may have been lost, ask again */
+                if (++retries > LINK_READ_RETRIES) {
+                    LOG_WARN("Link: gave up waiting for frame %u", rx_expected);
+                    return -1;
+                }
+                send_control(LINK_FRAME_NAK, rx_expected);
+                continue;
+            }
+        }
+
+        size_t n = rx_len - rx_pos;
+        if (n > len - total)
+            n = len - total;
+        memcpy(buffer + total, &rx_data[rx_pos], n);
+        rx_pos += n;
+        total += n;
+    }
+    return total;
+}
+
+int link_write(const uint8_t *buffer, size_t len)
+{
+    size_t total = 0;
+
+    pthread_mutex_lock(&tx_lock);
+    /* Closed since the caller checked link_active(): the host reads raw */
+    if (!atomic_load(&link_on)) {
+        pthread_mutex_unlock(&tx_lock);
+        return 0;
+    }
+    while (total < len) {
+        size_t n = len - total;
+        if (n > LINK_MAX_PAYLOAD)
+            n = LINK_MAX_PAYLOAD;
+
+        struct link_frame *f = &tx_history[tx_seq % LINK_HISTORY];
+        build_frame(f, LINK_FRAME_DATA, tx_seq, buffer + total, n);
+        if (send_frame(f) < 0) {
+            pthread_mutex_unlock(&tx_lock);
+            return -1;
+        }
+        tx_seq++;
+        total += n;
+    }
+    pthread_mutex_unlock(&tx_lock);
+    return total;
+}
+
+void link_report(void)
+{
+    if (link_retransmits || link_rx_bad || link_rx_gaps)
+        LOG_INFO("Link: %u frames retransmitted, %u received corrupted, %u out of order",
+                 link_retransmits, link_rx_bad, link_rx_gaps);
+}
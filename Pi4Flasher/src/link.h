@@ -0,0 +1,73 @@
+/*
+ * Pi4Flasher - Xbox 360 NAND Flasher for Raspberry Pi 4
+ * Copyright (c) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+#ifndef __LINK_H__
+#define __LINK_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Framed link layer
+ *
+ * After ENTER_FRAMED_MODE the byte stream in both directions is carried in
+ * COBS-encoded frames terminated by 0x00, each with a sequence number and a
+ * CRC32C (layout in protocol.h). A receiver that sees a gap in the sequence
+ * numbers or a corrupted frame sends a NAK for each missing sequence number
+ * and the sender retransmits just those frames from its history. Frames that
+ * arrive early are held until the gap is filled, so the commands above see
+ * the same byte stream as on a raw link.
+ *
+ * serial_read_exact() and serial_write() route through here while framed
+ * mode is active. Reading is done by the command loop only; writing is safe
+ * from any thread.
+ */
+
+/**
+ * Switch to framed mode and reset the sequence numbers
+ * @param fd Serial port file descriptor
+ */
+void link_start(int fd);
+
+/**
+ * Check whether framed mode is active
+ * @return non-zero in framed mode
+ */
+int link_active(void);
+
+/**
+ * Check whether received bytes are waiting to be read
+ * select() cannot see data that was already read into the frame buffers.
+ * @return non-zero if link_read_exact() has data without reading the port
+ */
+int link_pending(void);
+
+/**
+ * Read exactly len payload bytes, handling NAKs from the host on the way
+ * @param buffer Destination buffer
+ * @param len Number of bytes to read
+ * @return len on success, 0 if no data arrived, -1 on error
+ */
+int link_read_exact(uint8_t *buffer, size_t len);
+
+/**
+ * Send bytes as one or more data frames
+ * @param buffer Source buffer
+ * @param len Number of bytes to write
+ * @return len on success, 0 if the host closed the link meanwhile and
+ *         nothing was sent (the caller then writes raw), -1 on error
+ */
+int link_write(const uint8_t *buffer, size_t len);
+
+/**
+ * Log frames retransmitted and frames received corrupted or out of order
+ */
+void link_report(void);
+
+#endif /* __LINK_H__ */
@@ -0,0 +1,221 @@
+/*
+ * Pi4Flasher - Xbox 360 NAND Flasher for Raspberry Pi 4
+ * Copyright (c) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+#include "log.h"
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*
+ * Ring geometry: one single-producer/single-consumer ring per thread. A
+ * ring is released when its thread exits; threads beyond LOG_MAX_THREADS
+ * share one more ring under a lock.
+ */
+#define LOG_MAX_THREADS 8
+#define LOG_RING_SLOTS 256
+#define LOG_RECORD_LEN 124
+
+/* Drain thread idle interval */
+#define LOG_DRAIN_INTERVAL_NS 5000000
+
+struct log_record {
+    uint8_t level;
+    char text[LOG_RECORD_LEN];
+};
+
+struct log_ring {
+    struct log_record slots[LOG_RING_SLOTS];
+    atomic_uint head;       /* written by the owning thread */
+    atomic_uint tail;       /* written by the drain thread */
+    atomic_uint dropped;
+    atomic_int owned;       /* claimed by a live thread */
+};
+
+int log_threshold = LOG_LEVEL_INFO;
+
+static struct log_ring rings[LOG_MAX_THREADS];
+static struct log_ring shared_ring;
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local struct log_ring *thread_ring;
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static pthread_t drain_thread;
+static atomic_int drain_running;
+static atomic_int drain_stop;
+static int use_journal_prefix;
+
+/* syslog priorities understood by journald on stdout/stderr */
+static const char journal_prefix[][4] = { "<3>", "<4>", "<6>", "<7>" };
+
+static void log_emit(uint8_t level, const char *text)
+{
+    FILE *out = level <= LOG_LEVEL_WARN ? stderr : stdout;
+    fprintf(out, "%s%s\n", use_journal_prefix ? journal_prefix[level] : "", text);
+}
+
+/* Thread exit: hand the ring to the next thread, queued records still drain */
+static void log_ring_release(void *ring)
+{
+    atomic_store(&((struct log_ring *)ring)->owned, 0);
+}
+
+static void log_ring_key_create(void)
+{
+    pthread_key_create(&ring_key, log_ring_release);
+}
+
+static struct log_ring *log_ring_get(void)
+{
+    if (thread_ring)
+        return thread_ring;
+
+    pthread_once(&ring_key_once, log_ring_key_create);
+    for (int i = 0; i < LOG_MAX_THREADS; i++) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&rings[i].owned, &expected, 1)) {
+            pthread_setspecific(ring_key, &rings[i]);
+            thread_ring = &rings[i];
+            return thread_ring;
+        }
+    }
+    /* Not cached, a ring may be free again at the next record */
+    return &shared_ring;
+}
+
+static void log_ring_put(struct log_ring *r, uint8_t level, const char *fmt, va_list ap)
+{
+    unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    if (head - tail >= LOG_RING_SLOTS) {
+        atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    struct log_record *rec = &r->slots[head % LOG_RING_SLOTS];
+    rec->level = level;
+    vsnprintf(rec->text, sizeof(rec->text), fmt, ap);
+
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+/**
+ * Print every queued record, return number of records printed
+ */
+static int log_drain(void)
+{
+    int printed = 0;
+    for (int i = 0; i <= LOG_MAX_THREADS; i++) {
+        struct log_ring *r = i < LOG_MAX_THREADS ? &rings[i] : &shared_ring;
+        unsigned tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        unsigned head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+        while (tail != head) {
+            struct log_record *rec = &r->slots[tail % LOG_RING_SLOTS];
+            log_emit(rec->level, rec->text);
+            tail++;
+            printed++;
+        }
+        atomic_store_explicit(&r->tail, tail, memory_order_release);
+    }
+
+    if (printed) {
+        fflush(stdout);
+        fflush(stderr);
+    }
+    return printed;
+}
+
+static void *log_drain_main(void *arg)
+{
+    (void)arg;
+    uint64_t reported = 0;
+    const struct timespec idle = { 0, LOG_DRAIN_INTERVAL_NS };
+
+    while (!atomic_load(&drain_stop)) {
+        if (!log_drain())
+            nanosleep(&idle, NULL);
+
+        uint64_t dropped = log_dropped();
+        if (dropped != reported) {
+            fprintf(stderr, "%slog: %llu records dropped\n",
+                    use_journal_prefix ? journal_prefix[LOG_LEVEL_WARN] : "",
+                    (unsigned long long)(dropped - reported));
+            reported = dropped;
+        }
+    }
+
+    log_drain();
+    return NULL;
+}
+
+int log_init(enum log_level level)
+{
+    log_threshold = level;
+    use_journal_prefix = getenv("JOURNAL_STREAM") != NULL;
+
+    if (pthread_create(&drain_thread, NULL, log_drain_main, NULL) != 0) {
+        fprintf(stderr, "Failed to start log thread\n");
+        return -1;
+    }
+    atomic_store(&drain_running, 1);
+    return 0;
+}
+
+void log_shutdown(void)
+{
+    if (!atomic_load(&drain_running))
+        return;
+
+    atomic_store(&drain_stop, 1);
+    pthread_join(drain_thread, NULL);
+    atomic_store(&drain_running, 0);
+
+    /* Records queued after the thread's last pass, before writers saw
+     * drain_running cleared */
+    log_drain();
+}
+
+void log_write(enum log_level level, const char *fmt, ...)
+{
+    va_list ap;
+
+    if (!atomic_load_explicit(&drain_running, memory_order_relaxed)) {
+        char text[LOG_RECORD_LEN];
+        va_start(ap, fmt);
+        vsnprintf(text, sizeof(text), fmt, ap);
+        va_end(ap);
+        log_emit(level, text);
+        return;
+    }
+
+    struct log_ring *r = log_ring_get();
+    va_start(ap, fmt);
+    if (r == &shared_ring) {
+        pthread_mutex_lock(&shared_lock);
+        log_ring_put(r, level, fmt, ap);
+        pthread_mutex_unlock(&shared_lock);
+    } else {
+        log_ring_put(r, level, fmt, ap);
+    }
+    va_end(ap);
+}
+
+uint64_t log_dropped(void)
+{
+    uint64_t total = atomic_load_explicit(&shared_ring.dropped, memory_order_relaxed);
+
+    for (int i = 0; i < LOG_MAX_THREADS; i++)
+        total += atomic_load_explicit(&rings[i].dropped, memory_order_relaxed);
+    return total;
+}
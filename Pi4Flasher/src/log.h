@@ -0,0 +1,75 @@
+/*
+ * Pi4Flasher - Xbox 360 NAND Flasher for Raspberry Pi 4
+ * Copyright (c) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include <stdint.h>
+
+/*
+ * Leveled asynchronous logging.
+ *
+ * Callers format a record into a per-thread lock-free ring; a background
+ * thread drains the rings to stdout/stderr. When a ring is full the record
+ * is dropped and counted instead of blocking the caller, so logging never
+ * stalls NAND or serial I/O. A ring is released when its thread exits;
+ * while all rings are taken, further threads share one ring under a lock.
+ */
+
+enum log_level {
+    LOG_LEVEL_ERROR = 0,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG,
+};
+
+/* Records above this level are discarded before formatting */
+extern int log_threshold;
+
+#define LOG_ENABLED(level) ((level) <= log_threshold)
+
+#define LOG_AT(level, ...)                          \
+    do {                                            \
+        if (LOG_ENABLED(level))                     \
+            log_write((level), __VA_ARGS__);        \
+    } while (0)
+
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARN(...)  LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_INFO(...)  LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+/**
+ * Start the background drain thread
+ * Records written before this call are printed synchronously.
+ * @param level Most verbose level to keep
+ * @return 0 on success, -1 on failure
+ */
+int log_init(enum log_level level);
+
+/**
+ * Stop the drain thread after flushing all pending records
+ */
+void log_shutdown(void);
+
+/**
+ * Format and queue a record (use the LOG_* macros instead)
+ * @param level Record level
+ * @param fmt printf-style format string, newline is appended
+ */
+void log_write(enum log_level level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/**
+ * Get the number of records dropped because a ring was full
+ * @return Total dropped records since log_init()
+ */
+uint64_t log_dropped(void);
+
+#endif /* __LOG_H__ */
@@ -11,154 +11,312 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <fcntl.h>
-#include <termios.h>
 #include <errno.h>
 #include <signal.h>
 #include <sys/select.h>
 
+#include "log.h"
 #include "pi4_gpio.h"
 #include "pi4_spi.h"
 #include "xbox.h"
+#include "nand_wb.h"
+#include "nand_hash.h"
 #include "protocol.h"
+#include "serial.h"
+#include "stream.h"
+#include "dedup.h"
+#include "nand_layout.h"
+#include "link.h"
+#include "hash.h"
+#include "cmdq.h"
+#include "offline.h"
+#include "dump_cache.h"
+#include "nand_fuse.h"
+#include "nand_edc.h"
+#include <getopt.h>
 
-/* Serial port file descriptor */
-static int serial_fd = -1;
 static volatile int running = 1;
 
-/* Stream mode state */
-static int do_stream = 0;
-static int stream_emmc = 0;
-static uint32_t stream_offset = 0;
-static uint32_t stream_end = 0;
+/* Commands are struct tagged_cmd and NAND work goes through cmdq */
+static int tagged_mode = 0;
 
 /**
- * Initialize serial port for communication with J-Runner
- * @param device Serial device path (e.g., "/dev/ttyAMA0")
- * @param baud Baud rate (e.g., B115200)
- * @return 0 on success, -1 on failure
+ * Receive block hashes and reply with the erase blocks whose current NAND
+ * contents differ (DELTA_MANIFEST and VERIFY_FLASH)
  */
-static int serial_init(const char *device, speed_t baud)
+static void handle_manifest(struct cmd *cmd)
 {
-    struct termios tty;
+    const struct xbox_nand_geometry *geo = xbox_nand_get_geometry();
+    uint32_t sectors = geo->sectors_per_block;
+    uint32_t count, lba;
+    uint64_t nhash;
+    uint32_t reply[2] = { 0, 0 };
+
+    if (serial_read_exact((uint8_t *)&count, 4) != 4) {
+        LOG_ERROR("Failed to read manifest header");
+        return;
+    }
 
-    serial_fd = open(device, O_RDWR | O_NOCTTY | O_SYNC);
-    if (serial_fd < 0) {
-        fprintf(stderr, "Error opening %s: %s\n", device, strerror(errno));
-        return -1;
+    /* The range must lie inside the NAND; 64-bit sums cannot wrap */
+    uint32_t requested = count;
+    int valid;
+    if (cmd->cmd == DELTA_MANIFEST) {
+        valid = (uint64_t)cmd->lba + count <= geo->sectors / sectors;
+        lba = cmd->lba * sectors;
+        nhash = count;
+        count *= sectors;
+    } else {
+        valid = (uint64_t)cmd->lba + count <= geo->sectors;
+        lba = cmd->lba;
+        /* Blocks the range touches, as the host counts them */
+        nhash = count ? ((uint64_t)lba + count - 1) / sectors - lba / sectors + 1 : 0;
     }
 
-    /* Get current serial port settings */
-    if (tcgetattr(serial_fd, &tty) != 0) {
-        fprintf(stderr, "Error from tcgetattr: %s\n", strerror(errno));
-        close(serial_fd);
-        return -1;
+    uint64_t *hashes = NULL;
+    uint32_t *diff = NULL;
+    if (valid && nhash <= MANIFEST_MAX_BLOCKS) {
+        hashes = malloc(nhash * sizeof(*hashes) + 1);
+        diff = malloc(nhash * sizeof(*diff) + 1);
+    }
+    if (!hashes || !diff) {
+        LOG_WARN("%s: %u %s at %u rejected", cmd->cmd == VERIFY_FLASH ? "Verify" : "Manifest",
+                 requested, cmd->cmd == VERIFY_FLASH ? "sectors" : "blocks", cmd->lba);
+        serial_discard((size_t)nhash * sizeof(*hashes));
+        reply[0] = 0x8000;
+        serial_write((uint8_t *)reply, sizeof(reply));
+        free(hashes);
+        free(diff);
+        return;
     }
 
-    /* Set baud rate */
-    cfsetospeed(&tty, baud);
-    cfsetispeed(&tty, baud);
-
-    /* 8N1 mode, no hardware flow control */
-    tty.c_cflag = (tty.c_cflag & ~CSIZE) | CS8;  /* 8-bit chars */
-    tty.c_iflag &= ~IGNBRK;                       /* disable break processing */
-    tty.c_lflag = 0;                              /* no signaling chars, no echo */
-    tty.c_oflag = 0;                              /* no remapping, no delays */
-    tty.c_cc[VMIN] = 0;                           /* read doesn't block */
-    tty.c_cc[VTIME] = 5;                          /* 0.5 seconds read timeout */
-
-    tty.c_iflag &= ~(IXON | IXOFF | IXANY);       /* shut off xon/xoff ctrl */
-    tty.c_cflag |= (CLOCAL | CREAD);              /* ignore modem controls, enable reading */
-    tty.c_cflag &= ~(PARENB | PARODD);            /* no parity */
-    tty.c_cflag &= ~CSTOPB;                       /* 1 stop bit */
-    tty.c_cflag &= ~CRTSCTS;                      /* no hardware flow control */
-
-    /* Apply settings */
-    if (tcsetattr(serial_fd, TCSANOW, &tty) != 0) {
-        fprintf(stderr, "Error from tcsetattr: %s\n", strerror(errno));
-        close(serial_fd);
-        return -1;
+    if (serial_read_exact((uint8_t *)hashes, nhash * sizeof(*hashes)) !=
+        (int)(nhash * sizeof(*hashes))) {
+        LOG_ERROR("Failed to read manifest hashes");
+        free(hashes);
+        free(diff);
+        return;
     }
 
-    printf("Serial port %s opened successfully\n", device);
-    return 0;
+    if (cmd->cmd == VERIFY_FLASH)
+        reply[0] = nand_wb_sync();
+    else
+        nand_wb_flush();
+    reply[1] = nand_hash_compare(lba, count, hashes, diff);
+
+    serial_write((uint8_t *)reply, sizeof(reply));
+    serial_write((uint8_t *)diff, reply[1] * sizeof(*diff));
+    LOG_INFO("%s: %u of %u erase blocks differ",
+             cmd->cmd == VERIFY_FLASH ? "Verify" : "Manifest", reply[1], (uint32_t)nhash);
+
+    free(hashes);
+    free(diff);
 }
 
 /**
- * Read exactly n bytes from serial port (blocking with timeout)
+ * Read only the spare area of a sector range and reply with a compact table
  */
-static int serial_read_exact(uint8_t *buffer, size_t len)
+static void handle_spare_scan(struct cmd *cmd)
 {
-    size_t total = 0;
-    while (total < len) {
-        ssize_t n = read(serial_fd, buffer + total, len - total);
-        if (n < 0) {
-            if (errno == EINTR)
-                continue;
-            fprintf(stderr, "Serial read error: %s\n", strerror(errno));
-            return -1;
+    struct {
+        uint32_t count;
+        uint32_t mode;
+    } req;
+    uint32_t status = 0;
+
+    if (serial_read_exact((uint8_t *)&req, sizeof(req)) != sizeof(req)) {
+        LOG_ERROR("Failed to read spare scan request");
+        return;
+    }
+
+    if (req.mode != SPARE_SCAN_FULL && req.mode != SPARE_SCAN_BAD_BLOCKS) {
+        LOG_WARN("Unknown spare scan mode %u", req.mode);
+        status = 0x8000;
+        serial_write((uint8_t *)&status, 4);
+        return;
+    }
+
+    const struct xbox_nand_geometry *geo = xbox_nand_get_geometry();
+    if (cmd->lba >= geo->sectors) {
+        LOG_WARN("Spare scan at %u rejected, past the end of the NAND", cmd->lba);
+        status = 0x8000;
+        serial_write((uint8_t *)&status, 4);
+        return;
+    }
+
+    nand_wb_flush();
+    serial_write((uint8_t *)&status, 4);
+
+    /* The range stops at the end of the NAND */
+    uint32_t sectors = geo->sectors_per_block;
+    uint32_t end = (uint64_t)cmd->lba + req.count < geo->sectors ? cmd->lba + req.count :
+                   geo->sectors;
+    uint32_t failed[64];
+    uint32_t nfailed = 0;
+    uint8_t table[1024];
+    size_t used = 0;
+
+    /* Bad block markers live in the first pages, scan from the block start */
+    uint32_t lba = cmd->lba;
+    if (req.mode == SPARE_SCAN_BAD_BLOCKS && req.count)
+        lba -= lba % sectors;
+
+    while (lba < end) {
+        uint32_t start = lba;
+        uint8_t spare[0x10];
+        int ret;
+
+        if (req.mode == SPARE_SCAN_FULL) {
+            ret = xbox_nand_read_spare(lba, spare);
+            if (ret)
+                memset(spare, 0xFF, sizeof(spare));
+            memcpy(&table[used], spare, sizeof(spare));
+            used += sizeof(spare);
+            lba++;
+        } else {
+            /* The factory marker is in the first or second page */
+            uint32_t block_end = lba + sectors;
+            uint8_t flag = 0;
+
+            ret = xbox_nand_read_spare(lba, spare);
+            if (!ret && xbox_spare_is_bad(spare))
+                flag |= SPARE_FLAG_BAD;
+            else if (!ret) {
+                ret = xbox_nand_read_spare(lba + 1, spare);
+                if (!ret && xbox_spare_is_bad(spare))
+                    flag |= SPARE_FLAG_BAD;
+            }
+            if (ret)
+                flag |= SPARE_FLAG_READ_ERROR;
+            table[used++] = flag;
+            lba = block_end;
         }
-        if (n == 0) {
-            /* Timeout or EOF */
-            if (total == 0)
-                return 0;  /* No data yet */
-            continue;  /* Keep trying */
+
+        if (ret) {
+            if (nfailed < sizeof(failed) / sizeof(failed[0]))
+                failed[nfailed] = start;
+            nfailed++;
+        }
+
+        if (used + 0x10 > sizeof(table) || lba >= end) {
+            serial_write(table, used);
+            used = 0;
         }
-        total += n;
     }
-    return total;
+
+    /* Every failure is counted, only the first ones are listed */
+    uint32_t listed = nfailed < sizeof(failed) / sizeof(failed[0]) ? nfailed :
+                      sizeof(failed) / sizeof(failed[0]);
+    serial_write((uint8_t *)&nfailed, 4);
+    serial_write((uint8_t *)failed, listed * 4);
+    LOG_INFO("Spare scan: %u sectors from %u, %u read errors", end - cmd->lba, cmd->lba, nfailed);
 }
 
 /**
- * Write data to serial port
+ * Replace the set of sector hashes the host already has
  */
-static int serial_write(const uint8_t *buffer, size_t len)
+static void handle_known_sectors(struct cmd *cmd)
 {
-    size_t total = 0;
-    while (total < len) {
-        ssize_t n = write(serial_fd, buffer + total, len - total);
-        if (n < 0) {
-            if (errno == EINTR)
-                continue;
-            fprintf(stderr, "Serial write error: %s\n", strerror(errno));
-            return -1;
-        }
-        total += n;
+    uint32_t count = cmd->lba;
+    uint32_t status = 0;
+    uint64_t *hashes = NULL;
+
+    if (count <= KNOWN_SECTORS_MAX)
+        hashes = malloc(count * sizeof(*hashes) + 1);
+    if (!hashes) {
+        LOG_WARN("Known sector set of %u hashes rejected", count);
+        serial_discard((size_t)count * sizeof(*hashes));
+        status = 0x8000;
+        serial_write((uint8_t *)&status, 4);
+        return;
     }
-    return total;
+
+    if (serial_read_exact((uint8_t *)hashes, count * sizeof(*hashes)) !=
+        (int)(count * sizeof(*hashes))) {
+        LOG_ERROR("Failed to read known sector hashes");
+        free(hashes);
+        return;
+    }
+
+    dedup_set(hashes, count);
+    serial_write((uint8_t *)&status, 4);
+    LOG_INFO("Known sectors: %u hashes loaded", count);
 }
 
 /**
- * Handle streaming mode for fast bulk reads
+ * Reply with the essential regions of the image and stream their sectors
  */
-static void handle_stream(void)
+static void handle_essentials(struct cmd *cmd)
 {
-    if (!do_stream)
-        return;
+    struct essential_region regions[NAND_LAYOUT_MAX_REGIONS];
+    struct nand_span spans[NAND_LAYOUT_MAX_REGIONS];
+    uint32_t reply[2] = { 0, 0 };
+
+    nand_wb_flush();
+    int ret = nand_layout_essentials(regions, &reply[1]);
+    if (ret) {
+        reply[0] = ret < 0 ? 0x8000 : (uint32_t)ret;
+        reply[1] = 0;
+    }
 
-    if (stream_offset >= stream_end) {
-        do_stream = 0;
+    serial_write((uint8_t *)reply, sizeof(reply));
+    serial_write((uint8_t *)regions, reply[1] * sizeof(*regions));
+    if (reply[0] != 0) {
+        LOG_WARN("Essentials: ERROR 0x%X", reply[0]);
         return;
     }
 
-    if (!stream_emmc) {
-        /* NAND streaming */
-        uint8_t buffer[4 + 0x210];
-        uint32_t ret = xbox_nand_read_block(stream_offset, &buffer[4], &buffer[4 + 0x200]);
-        *(uint32_t *)buffer = ret;
+    uint32_t nspans = nand_layout_spans(regions, reply[1], spans);
+    uint32_t sectors = 0;
+    for (uint32_t i = 0; i < nspans; i++)
+        sectors += spans[i].end - spans[i].start;
 
-        if (ret == 0) {
-            serial_write(buffer, sizeof(buffer));
-            stream_offset++;
-        } else {
-            serial_write((uint8_t *)&ret, 4);
-            do_stream = 0;
-        }
-    } else {
-        /* eMMC streaming - not implemented yet */
-        fprintf(stderr, "eMMC streaming not yet implemented\n");
-        do_stream = 0;
+    stream_start_spans(spans, nspans, cmd->lba);
+    LOG_INFO("Essentials: %u regions, %u sectors in %u runs, flags 0x%X",
+             reply[1], sectors, nspans, cmd->lba);
+}
+
+/**
+ * Describe this build and the attached NAND (GET_CAPABILITIES)
+ */
+static void fill_capabilities(struct capabilities *c)
+{
+    const struct xbox_nand_geometry *geo = xbox_nand_get_geometry();
+    struct capabilities caps;
+
+    memset(&caps, 0, sizeof(caps));
+    caps.protocol = PI4FLASHER_PROTOCOL_VERSION;
+    caps.features = CAP_WRITE_COALESCING | CAP_SYNC | CAP_DELTA_MANIFEST | CAP_VERIFY |
+                    CAP_SPARE_SCAN | CAP_STREAM_EX | CAP_KNOWN_SECTORS |
+                    CAP_ESSENTIALS | CAP_FRAMED | CAP_STREAM_ABORT | CAP_WRITE_DATA;
+    if (cmdq_running())
+        caps.features |= CAP_TAGGED;
+    if (crc32c_hw())
+        caps.features |= CAP_HW_CRC32C;
+    caps.stream_flags = STREAM_FLAG_ERASED | STREAM_FLAG_DEDUP | STREAM_FLAG_CONSENSUS |
+                        STREAM_FLAG_CRC | STREAM_FLAG_CREDIT | STREAM_FLAG_REMAP |
+                        STREAM_FLAG_EDC;
+    caps.codecs = 1u << STREAM_CODEC_NONE;
+    if (stream_can_compress()) {
+        caps.stream_flags |= STREAM_FLAG_COMPRESS;
+        caps.codecs |= (1u << STREAM_CODEC_RLE) | (1u << STREAM_CODEC_LZ4);
     }
+    caps.batch_sectors = STREAM_BATCH_SECTORS;
+    caps.consensus_max = STREAM_CONSENSUS_MAX;
+    caps.link_max_payload = LINK_MAX_PAYLOAD;
+    caps.link_history = LINK_HISTORY;
+    caps.link_rx_window = LINK_RX_WINDOW;
+    caps.sector_size = 0x210;
+    caps.manifest_max = MANIFEST_MAX_BLOCKS;
+    caps.known_max = KNOWN_SECTORS_MAX;
+    caps.flash_config = xbox_get_flash_config();
+    caps.block_size = geo->block_size;
+    caps.sectors_per_block = geo->sectors_per_block;
+    caps.meta_type = geo->meta_type;
+    caps.tagged_depth = TAGGED_QUEUE_DEPTH;
+    caps.tagged_max_read = TAGGED_MAX_READ;
+
+    *c = caps;
+    LOG_INFO("Capabilities: protocol %u, features 0x%X", caps.protocol, caps.features);
 }
 
 /**
@@ -170,26 +328,27 @@ static void handle_command(struct cmd *cmd)
         case GET_VERSION: {
             uint32_t ver = PI4FLASHER_VERSION;
             serial_write((uint8_t *)&ver, 4);
-            printf("Version request: %u\n", ver);
+            LOG_INFO("Version request: %u", ver);
             break;
         }
 
         case GET_FLASH_CONFIG: {
             uint32_t fc = xbox_get_flash_config();
             serial_write((uint8_t *)&fc, 4);
-            printf("Flash config: 0x%08X\n", fc);
+            LOG_INFO("Flash config: 0x%08X", fc);
             break;
         }
 
         case READ_FLASH: {
             uint8_t buffer[0x210];
-            uint32_t ret = xbox_nand_read_block(cmd->lba, buffer, &buffer[0x200]);
+            nand_wb_flush();
+            uint32_t ret = dump_cache_read(cmd->lba, buffer, &buffer[0x200]);
             serial_write((uint8_t *)&ret, 4);
             if (ret == 0) {
                 serial_write(buffer, sizeof(buffer));
-                printf("Read block %u: OK\n", cmd->lba);
+                LOG_DEBUG("Read block %u: OK", cmd->lba);
             } else {
-                printf("Read block %u: ERROR 0x%X\n", cmd->lba, ret);
+                LOG_WARN("Read block %u: ERROR 0x%X", cmd->lba, ret);
             }
             break;
         }
@@ -197,35 +356,197 @@ static void handle_command(struct cmd *cmd)
         case WRITE_FLASH: {
             uint8_t buffer[0x210];
             if (serial_read_exact(buffer, sizeof(buffer)) != sizeof(buffer)) {
-                fprintf(stderr, "Failed to read write data\n");
+                LOG_ERROR("Failed to read write data");
+                return;
+            }
+            uint32_t ret = nand_wb_write(cmd->lba, buffer, &buffer[0x200]);
+            serial_write((uint8_t *)&ret, 4);
+            if (ret == 0) {
+                LOG_DEBUG("Write block %u: OK", cmd->lba);
+            } else {
+                LOG_WARN("Write block %u: ERROR 0x%X", cmd->lba, ret);
+            }
+            break;
+        }
+
+        case WRITE_FLASH_DATA: {
+            uint8_t buffer[0x210];
+            if (serial_read_exact(buffer, 0x200) != 0x200) {
+                LOG_ERROR("Failed to read write data");
                 return;
             }
-            uint32_t ret = xbox_nand_write_block(cmd->lba, buffer, &buffer[0x200]);
+            nand_edc_make_sector(cmd->lba, buffer);
+            uint32_t ret = nand_wb_write(cmd->lba, buffer, &buffer[0x200]);
             serial_write((uint8_t *)&ret, 4);
             if (ret == 0) {
-                printf("Write block %u: OK\n", cmd->lba);
+                LOG_DEBUG("Write block %u (data only): OK", cmd->lba);
             } else {
-                printf("Write block %u: ERROR 0x%X\n", cmd->lba, ret);
+                LOG_WARN("Write block %u (data only): ERROR 0x%X", cmd->lba, ret);
             }
             break;
         }
 
+        case SYNC_FLASH: {
+            uint32_t ret = nand_wb_sync();
+            serial_write((uint8_t *)&ret, 4);
+            if (ret != 0)
+                LOG_WARN("Sync: ERROR 0x%X", ret);
+            nand_wb_report();
+            break;
+        }
+
+        case DELTA_MANIFEST:
+        case VERIFY_FLASH: {
+            handle_manifest(cmd);
+            break;
+        }
+
+        case SCAN_SPARE: {
+            handle_spare_scan(cmd);
+            break;
+        }
+
         case READ_FLASH_STREAM: {
-            stream_emmc = 0;
-            do_stream = 1;
-            stream_offset = 0;
-            stream_end = cmd->lba;
-            printf("Stream read: %u blocks\n", stream_end);
+            stream_start(0, cmd->lba, 0);
+            LOG_INFO("Stream read: %u blocks", cmd->lba);
+            break;
+        }
+
+        case READ_FLASH_STREAM_EX: {
+            struct stream_request req;
+            if (serial_read_exact((uint8_t *)&req, sizeof(req)) != sizeof(req)) {
+                LOG_ERROR("Failed to read stream request");
+                return;
+            }
+            stream_start(cmd->lba, req.end, req.flags);
+            LOG_INFO("Stream read: blocks %u-%u, flags 0x%X", cmd->lba, req.end, req.flags);
+            break;
+        }
+
+        case SET_STREAM_CODEC: {
+            uint32_t codec = stream_set_codec(cmd->lba);
+            serial_write((uint8_t *)&codec, 4);
+            LOG_INFO("Stream codec: %u (host mask 0x%X)", codec, cmd->lba);
+            break;
+        }
+
+        case LOAD_KNOWN_SECTORS: {
+            handle_known_sectors(cmd);
+            break;
+        }
+
+        case READ_FLASH_ESSENTIALS: {
+            handle_essentials(cmd);
+            break;
+        }
+
+        case ENTER_FRAMED_MODE: {
+            uint32_t status = 0;
+            serial_write((uint8_t *)&status, 4);
+            link_start(serial_get_fd());
+            LOG_INFO("Framed mode started");
+            break;
+        }
+
+        case GET_CAPABILITIES: {
+            struct capabilities caps;
+            uint32_t len = sizeof(caps);
+            fill_capabilities(&caps);
+            serial_write((uint8_t *)&len, 4);
+            serial_write((uint8_t *)&caps, sizeof(caps));
+            break;
+        }
+
+        case SET_TAGGED_MODE: {
+            uint32_t status = 0;
+            if (cmd->lba != 1 || stream_active() || !cmdq_running())
+                status = TAGGED_UNSUPPORTED;
+            serial_write((uint8_t *)&status, 4);
+            if (status == 0) {
+                tagged_mode = 1;
+                LOG_INFO("Tagged mode started");
+            }
+            break;
+        }
+
+        case STREAM_CREDIT: {
+            stream_grant(cmd->lba);
+            break;
+        }
+
+        case STREAM_ABORT: {
+            uint32_t last = stream_abort();
+            LOG_INFO("Stream abort: last block sent 0x%X", last);
             break;
         }
 
         case REBOOT_TO_BOOTLOADER: {
-            printf("Reboot command received (not implemented on Pi4)\n");
+            LOG_INFO("Reboot command received (not implemented on Pi4)");
             break;
         }
 
         default:
-            printf("Unknown command: 0x%02X\n", cmd->cmd);
+            LOG_WARN("Unknown command: 0x%02X", cmd->cmd);
+            break;
+    }
+}
+
+/**
+ * Process a command in tagged mode: answer it now or queue it for the engine
+ */
+static void handle_tagged_command(const struct tagged_cmd *tc)
+{
+    uint8_t payload[TAGGED_MAX_PAYLOAD];
+
+    if (tc->len > sizeof(payload)) {
+        LOG_WARN("Tagged command 0x%02X: payload of %u bytes rejected", tc->cmd, tc->len);
+        serial_discard(tc->len);
+        cmdq_reply_status(tc->tag, tc->cmd, 0x8000);
+        return;
+    }
+    if (tc->len && serial_read_exact(payload, tc->len) != (int)tc->len) {
+        LOG_ERROR("Failed to read tagged command payload");
+        return;
+    }
+
+    switch (tc->cmd) {
+        case GET_VERSION:
+            cmdq_reply_status(tc->tag, tc->cmd, PI4FLASHER_VERSION);
+            break;
+
+        case GET_FLASH_CONFIG:
+            /* Read in main() before the engine starts, no NAND access */
+            cmdq_reply_status(tc->tag, tc->cmd, xbox_get_flash_config());
+            break;
+
+        case GET_CAPABILITIES: {
+            struct capabilities caps;
+            fill_capabilities(&caps);
+            cmdq_reply(tc->tag, tc->cmd, &caps, sizeof(caps));
+            break;
+        }
+
+        case READ_FLASH:
+        case WRITE_FLASH:
+        case WRITE_FLASH_DATA:
+        case SYNC_FLASH:
+            if (cmdq_submit(tc->tag, tc->cmd, tc->lba, payload, tc->len) != 0)
+                cmdq_reply_status(tc->tag, tc->cmd, TAGGED_QUEUE_FULL);
+            break;
+
+        case SET_TAGGED_MODE:
+            if (tc->lba != 0) {
+                cmdq_reply_status(tc->tag, tc->cmd, 0);
+                break;
+            }
+            cmdq_wait_idle();
+            cmdq_reply_status(tc->tag, tc->cmd, 0);
+            tagged_mode = 0;
+            LOG_INFO("Tagged mode ended");
+            break;
+
+        default:
+            cmdq_reply_status(tc->tag, tc->cmd, TAGGED_UNSUPPORTED);
             break;
     }
 }
@@ -239,20 +560,163 @@ static void signal_handler(int signum)
     running = 0;
 }
 
+/* Offline mode selected on the command line */
+enum offline_mode {
+    OFFLINE_NONE,
+    OFFLINE_DUMP,
+    OFFLINE_FLASH,
+    OFFLINE_MOUNT,
+};
+
+struct offline_args {
+    enum offline_mode mode;
+    const char *path;           /* output, input or mount point */
+    uint32_t sectors;           /* 0 for the whole NAND */
+    int verify;
+};
+
+/**
+ * Print command line usage
+ */
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-v] [-q] [-c cache_dir] [serial_device]\n", prog);
+    fprintf(stderr, "       %s [-v] [-q] dump --out FILE [--sectors N]\n", prog);
+    fprintf(stderr, "       %s [-v] [-q] flash --in FILE [--no-verify]\n", prog);
+    fprintf(stderr, "       %s [-v] [-q] mount DIR [--sectors N]\n", prog);
+    fprintf(stderr, "  -v  verbose, log every NAND block access\n");
+    fprintf(stderr, "  -q  quiet, log warnings and errors only\n");
+    fprintf(stderr, "  -c  keep dumps per console in cache_dir and serve repeated\n");
+    fprintf(stderr, "      reads of unchanged erase blocks from there\n");
+    fprintf(stderr, "  dump   read the NAND into FILE on the Pi, without a host\n");
+    fprintf(stderr, "         (N sectors of 0x210 bytes, default the whole NAND)\n");
+    fprintf(stderr, "  flash  write the image FILE to the NAND and verify it\n");
+    fprintf(stderr, "  mount  show the NAND as files data, spare and raw in DIR\n");
+}
+
+/**
+ * Parse the options of an offline mode
+ * @param argc Arguments starting with the mode name
+ * @return 0 on success, -1 on invalid options
+ */
+static int parse_offline_args(int argc, char *argv[], struct offline_args *args)
+{
+    static const struct option options[] = {
+        { "out", required_argument, NULL, 'o' },
+        { "in", required_argument, NULL, 'i' },
+        { "sectors", required_argument, NULL, 'n' },
+        { "no-verify", no_argument, NULL, 'N' },
+        { NULL, 0, NULL, 0 }
+    };
+    enum offline_mode mode = args->mode;
+    int opt;
+
+    optind = 1;
+    while ((opt = getopt_long(argc, argv, "o:i:n:", options, NULL)) != -1) {
+        switch (opt) {
+            case 'o':
+                if (mode != OFFLINE_DUMP)
+                    return -1;
+                args->path = optarg;
+                break;
+            case 'i':
+                if (mode != OFFLINE_FLASH)
+                    return -1;
+                args->path = optarg;
+                break;
+            case 'n': {
+                char *end;
+                unsigned long n = strtoul(optarg, &end, 0);
+                if (mode == OFFLINE_FLASH || *end || n == 0 || n > UINT32_MAX)
+                    return -1;
+                args->sectors = n;
+                break;
+            }
+            case 'N':
+                if (mode != OFFLINE_FLASH)
+                    return -1;
+                args->verify = 0;
+                break;
+            default:
+                return -1;
+        }
+    }
+
+    /* The mount point is the only positional argument */
+    if (mode == OFFLINE_MOUNT && optind + 1 == argc)
+        args->path = argv[optind++];
+    return args->path && optind == argc ? 0 : -1;
+}
+
+/**
+ * Default the sector count of an offline mode to the NAND size, and check
+ * a given one against it. Needs the SMC stopped to read the geometry.
+ * @return 0 on success, -1 if the count runs past the end of the NAND
+ */
+static int offline_check_sectors(struct offline_args *args)
+{
+    uint32_t total = xbox_nand_get_geometry()->sectors;
+
+    if (!args->sectors) {
+        args->sectors = total;
+    } else if (args->sectors > total) {
+        LOG_ERROR("--sectors 0x%X is past the end of the NAND (0x%X sectors)",
+                  args->sectors, total);
+        return -1;
+    }
+    return 0;
+}
+
 /**
  * Main application loop
  */
 int main(int argc, char *argv[])
 {
     const char *serial_device = "/dev/ttyAMA0";
+    struct offline_args offline = { OFFLINE_NONE, NULL, 0, 1 };
+    const char *cache_dir = NULL;
+    enum log_level level = LOG_LEVEL_INFO;
+    int opt;
+
+    /* Parse command line arguments, stopping at a mode name */
+    while ((opt = getopt(argc, argv, "+vqc:")) != -1) {
+        switch (opt) {
+            case 'v':
+                level = LOG_LEVEL_DEBUG;
+                break;
+            case 'q':
+                level = LOG_LEVEL_WARN;
+                break;
+            case 'c':
+                cache_dir = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind < argc) {
+        if (strcmp(argv[optind], "dump") == 0)
+            offline.mode = OFFLINE_DUMP;
+        else if (strcmp(argv[optind], "flash") == 0)
+            offline.mode = OFFLINE_FLASH;
+        else if (strcmp(argv[optind], "mount") == 0)
+            offline.mode = OFFLINE_MOUNT;
+    }
+    if (offline.mode != OFFLINE_NONE) {
+        if (parse_offline_args(argc - optind, argv + optind, &offline) != 0) {
+            usage(argv[0]);
+            return 1;
+        }
+    } else if (optind < argc) {
+        serial_device = argv[optind];
+    }
 
     printf("Pi4Flasher - Xbox 360 NAND Flasher for Raspberry Pi 4\n");
     printf("Version: %d\n\n", PI4FLASHER_VERSION);
 
-    /* Parse command line arguments */
-    if (argc > 1) {
-        serial_device = argv[1];
-    }
+    if (log_init(level) != 0)
+        return 1;
 
     /* Set up signal handlers */
     signal(SIGINT, signal_handler);
@@ -261,16 +725,60 @@ int main(int argc, char *argv[])
     /* Initialize BCM2835 GPIO library */
     if (pi4_gpio_init() != 0) {
         fprintf(stderr, "Failed to initialize GPIO (are you running as root?)\n");
+        log_shutdown();
         return 1;
     }
 
     /* Initialize Xbox NAND interface */
     xbox_init();
 
+    if (nand_wb_init() != 0) {
+        pi4_gpio_deinit();
+        log_shutdown();
+        return 1;
+    }
+
+    /* Offline modes keep the console off the NAND for their whole run */
+    if (offline.mode != OFFLINE_NONE) {
+        int ret;
+        xbox_stop_smc();
+        /* First geometry read, before any worker thread starts */
+        if (offline_check_sectors(&offline) != 0)
+            ret = -1;
+        else if (offline.mode == OFFLINE_DUMP)
+            ret = offline_dump(offline.path, offline.sectors, &running);
+        else if (offline.mode == OFFLINE_FLASH)
+            ret = offline_flash(offline.path, offline.verify, &running);
+        else
+            ret = nand_fuse_run(offline.path, offline.sectors);
+        nand_wb_deinit();
+        xbox_start_smc();
+        pi4_gpio_deinit();
+        log_shutdown();
+        return ret ? 1 : 0;
+    }
+
+    /* Read the flash config before any other thread may touch the NAND:
+     * it and the geometry are cached without a lock */
+    xbox_nand_get_geometry();
+
+    if (cache_dir && dump_cache_enable(cache_dir) != 0)
+        LOG_WARN("Dump cache unavailable, reading from the NAND");
+
+    /* Compressed streams fall back to raw frames without the worker */
+    stream_init();
+    if (cmdq_init() != 0)
+        LOG_WARN("Tagged mode unavailable without the engine thread");
+
     /* Initialize serial communication */
     if (serial_init(serial_device, B115200) != 0) {
         fprintf(stderr, "Failed to initialize serial port\n");
+        cmdq_deinit();
+        stream_deinit();
+        nand_wb_deinit();
+        dump_cache_close();
         pi4_gpio_deinit();
+        log_shutdown();
         return 1;
     }
 
@@ -279,26 +787,37 @@ int main(int argc, char *argv[])
     /* Main command loop */
     while (running) {
         /* Handle streaming if active */
-        handle_stream();
+        stream_step();
 
-        /* Check for incoming commands */
+        /* Check for incoming commands, without waiting while streaming
+         * unless the stream is out of credit */
+        int fd = serial_get_fd();
         fd_set readfds;
         struct timeval tv;
         FD_ZERO(&readfds);
-        FD_SET(serial_fd, &readfds);
+        FD_SET(fd, &readfds);
         tv.tv_sec = 0;
-        tv.tv_usec = 100000;  /* 100ms timeout */
+        tv.tv_usec = stream_ready() ? 0 : 100000;  /* 100ms timeout */
 
-        int ret = select(serial_fd + 1, &readfds, NULL, NULL, &tv);
+        int ret = serial_pending() ? 1 : select(fd + 1, &readfds, NULL, NULL, &tv);
         if (ret < 0) {
             if (errno == EINTR)
                 continue;
-            fprintf(stderr, "Select error: %s\n", strerror(errno));
+            LOG_ERROR("Select error: %s", strerror(errno));
             break;
         }
 
-        if (ret == 0)
+        if (ret == 0) {
+            nand_wb_poll();
             continue;  /* Timeout, check stream and loop again */
+        }
+
+        if (tagged_mode) {
+            struct tagged_cmd tc;
+            if (serial_read_exact((uint8_t *)&tc, sizeof(tc)) == sizeof(tc))
+                handle_tagged_command(&tc);
+            continue;
+        }
 
         /* Read command header */
         struct cmd cmd;
@@ -312,14 +831,27 @@ int main(int argc, char *argv[])
 
     printf("\nShutting down Pi4Flasher...\n");
 
+    cmdq_deinit();
+    stream_deinit();
+    nand_wb_deinit();
+    nand_wb_report();
+    xbox_nand_timing_report();
+    link_report();
+    dump_cache_report();
+    dump_cache_close();
+
     /* Start SMC before exit */
     xbox_start_smc();
 
     /* Cleanup */
-    if (serial_fd >= 0)
-        close(serial_fd);
+    serial_close();
     pi4_gpio_deinit();
 
+    if (log_dropped())
+        LOG_WARN("%llu log records dropped", (unsigned long long)log_dropped());
+    dedup_set(NULL, 0);
+    log_shutdown();
+
     return 0;
 }
 
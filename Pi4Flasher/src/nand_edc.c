@@ -0,0 +1,98 @@
+/*
+ * Pi4Flasher - Xbox 360 NAND Flasher for Raspberry Pi 4
+ * Copyright (c) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+#include "nand_edc.h"
+#include "xbox.h"
+#include <pthread.h>
+#include <string.h>
+
+/* 0x6954559 reflected: the shift drops its low bit */
+#define EDC_POLY 0x034AA2AC
+#define EDC_MASK 0x03FFFFFF
+
+/* Bytes covered in whole, then EDC_TAIL_BITS bits of the next one */
+#define EDC_BYTES 0x20C
+#define EDC_TAIL_BITS 6
+
+/*
+ * Slicing-by-8 tables: edc_table[k][b] is the register after byte b
+ * followed by k zero bytes, so eight bytes take eight independent lookups
+ * instead of a chain of eight.
+ */
+static uint32_t edc_table[8][256];
+static pthread_once_t edc_table_once = PTHREAD_ONCE_INIT;
+
+static void edc_build_tables(void)
+{
+    for (uint32_t b = 0; b < 256; b++) {
+        uint32_t r = b;
+        for (int i = 0; i < 8; i++)
+            r = (r >> 1) ^ ((r & 1) ? EDC_POLY : 0);
+        edc_table[0][b] = r;
+    }
+    for (int k = 1; k < 8; k++) {
+        for (uint32_t b = 0; b < 256; b++) {
+            uint32_t r = edc_table[k - 1][b];
+            edc_table[k][b] = (r >> 8) ^ edc_table[0][r & 0xFF];
+        }
+    }
+}
+
+uint32_t nand_edc_calc(const uint8_t *sector)
+{
+    const uint8_t *p = sector;
+    const uint8_t *end = sector + EDC_BYTES;
+    uint32_t r = 0;
+
+    pthread_once(&edc_table_once, edc_build_tables);
+
+    /* The input bits are inverted, a whole word at a time */
+    for (; end - p >= 8; p += 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        v = ~v ^ r;
+        r = edc_table[7][v & 0xFF] ^ edc_table[6][(v >> 8) & 0xFF] ^
+            edc_table[5][(v >> 16) & 0xFF] ^ edc_table[4][(v >> 24) & 0xFF] ^
+            edc_table[3][(v >> 32) & 0xFF] ^ edc_table[2][(v >> 40) & 0xFF] ^
+            edc_table[1][(v >> 48) & 0xFF] ^ edc_table[0][v >> 56];
+    }
+    while (p < end)
+        r = (r >> 8) ^ edc_table[0][(r ^ (uint8_t)~*p++) & 0xFF];
+
+    uint8_t tail = ~*p;
+    for (int i = 0; i < EDC_TAIL_BITS; i++) {
+        r ^= (tail >> i) & 1;
+        r = (r >> 1) ^ ((r & 1) ? EDC_POLY : 0);
+    }
+    return ~r & EDC_MASK;
+}
+
+int nand_edc_check(const uint8_t *sector)
+{
+    uint32_t word = sector[EDC_BYTES] | (sector[EDC_BYTES + 1] << 8) |
+                    (sector[EDC_BYTES + 2] << 16) | ((uint32_t)sector[EDC_BYTES + 3] << 24);
+    return (word >> EDC_TAIL_BITS) == nand_edc_calc(sector);
+}
+
+void nand_edc_store(uint8_t *sector)
+{
+    uint32_t word = (nand_edc_calc(sector) << EDC_TAIL_BITS) |
+                    (sector[EDC_BYTES] & ((1 << EDC_TAIL_BITS) - 1));
+
+    sector[EDC_BYTES] = word & 0xFF;
+    sector[EDC_BYTES + 1] = (word >> 8) & 0xFF;
+    sector[EDC_BYTES + 2] = (word >> 16) & 0xFF;
+    sector[EDC_BYTES + 3] = word >> 24;
+}
+
+void nand_edc_make_sector(uint32_t lba, uint8_t *sector)
+{
+    xbox_spare_init(&sector[0x200], lba / xbox_nand_get_geometry()->sectors_per_block);
+    nand_edc_store(sector);
+}
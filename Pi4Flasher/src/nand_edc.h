@@ -0,0 +1,57 @@
+/*
+ * Pi4Flasher - Xbox 360 NAND Flasher for Raspberry Pi 4
+ * Copyright (c) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+#ifndef __NAND_EDC_H__
+#define __NAND_EDC_H__
+
+#include <stdint.h>
+
+/*
+ * Sector EDC
+ *
+ * The flash controller protects every sector with a 26-bit error detection
+ * code over the first 0x1066 bits of the raw sector: the 512 data bytes,
+ * spare bytes 0-11 and the low 6 bits of spare byte 12. It is a reflected
+ * CRC with polynomial 0x6954559 over the inverted input bits, inverted at
+ * the end, and is stored in the top 26 bits of the little-endian word at
+ * spare offset 12. This is the "ECC" J-Runner and the Free60 tools add to
+ * data-only images.
+ */
+
+/**
+ * Compute the EDC of a raw sector
+ * @param sector 0x210 bytes of data and spare
+ * @return 26-bit EDC
+ */
+uint32_t nand_edc_calc(const uint8_t *sector);
+
+/**
+ * Check the EDC stored in a raw sector
+ * Erased pages carry no EDC; callers skip sectors that are all 0xFF.
+ * @param sector 0x210 bytes of data and spare
+ * @return 1 if the stored EDC matches the sector, 0 otherwise
+ */
+int nand_edc_check(const uint8_t *sector);
+
+/**
+ * Compute the EDC of a raw sector and store it in its spare area
+ * @param sector 0x210 bytes of data and spare, updated in place
+ */
+void nand_edc_store(uint8_t *sector);
+
+/**
+ * Fill in the spare area of a data-only sector
+ * Builds the spare of a good block for the current layout (see
+ * xbox_spare_init()) and stores the EDC, as image tools do when adding ECC.
+ * @param lba Logical block address (512-byte sector)
+ * @param sector 0x200 bytes of data followed by room for the 0x10 spare bytes
+ */
+void nand_edc_make_sector(uint32_t lba, uint8_t *sector);
+
+#endif /* __NAND_EDC_H__ */
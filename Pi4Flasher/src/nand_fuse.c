@@ -0,0 +1,319 @@
+/*
+ * Pi4Flasher - Xbox 360 NAND Flasher for Raspberry Pi 4
+ * Copyright (c) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+#include "nand_fuse.h"
+#include "log.h"
+
+#ifdef HAVE_FUSE
+
+#define FUSE_USE_VERSION 31
+
+#include "nand_wb.h"
+#include "xbox.h"
+#include <errno.h>
+#include <fuse.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define SECTOR_SIZE 0x210
+#define FUSE_CACHE_BLOCKS 16
+#define MAX_LISTED_ERRORS 64
+
+/* A view of the NAND: stride bytes of every sector, starting at offset */
+struct nand_file {
+    const char *path;
+    uint32_t offset;
+    uint32_t stride;
+};
+
+static const struct nand_file nand_files[] = {
+    { "/data", 0, 0x200 },
+    { "/spare", 0x200, 0x10 },
+    { "/raw", 0, SECTOR_SIZE },
+};
+
+#define NAND_FILE_COUNT (sizeof(nand_files) / sizeof(nand_files[0]))
+
+/* Erase blocks kept in memory, least recently used evicted first */
+struct cached_block {
+    uint32_t block;             /* UINT32_MAX when empty */
+    uint64_t used;
+    uint8_t *raw;               /* sectors_per_block sectors of 0x210 bytes */
+};
+
+static struct cached_block fuse_cache[FUSE_CACHE_BLOCKS];
+static uint64_t fuse_clock;
+static uint32_t fuse_sectors;
+static uint32_t fuse_spb;
+
+/* Statistics */
+static uint32_t fuse_hits;
+static uint32_t fuse_misses;
+static uint32_t fuse_read_errors;
+
+static const struct nand_file *find_file(const char *path)
+{
+    for (size_t i = 0; i < NAND_FILE_COUNT; i++) {
+        if (strcmp(path, nand_files[i].path) == 0)
+            return &nand_files[i];
+    }
+    return NULL;
+}
+
+/**
+ * Get an erase block, reading the whole block on a miss
+ * A sector that fails to read twice is zeroed and logged, as in offline
+ * dumps, so reads across a bad block still complete.
+ * @return Cached block
+ */
+static struct cached_block *get_block(uint32_t block)
+{
+    struct cached_block *victim = &fuse_cache[0];
+
+    for (int i = 0; i < FUSE_CACHE_BLOCKS; i++) {
+        struct cached_block *c = &fuse_cache[i];
+        if (c->block == block) {
+            c->used = ++fuse_clock;
+            fuse_hits++;
+            return c;
+        }
+        if (c->used < victim->used)
+            victim = c;
+    }
+
+    fuse_misses++;
+    victim->block = UINT32_MAX;
+    nand_wb_flush();
+
+    uint32_t lba = block * fuse_spb;
+    for (uint32_t i = 0; i < fuse_spb && lba + i < fuse_sectors; i++) {
+        uint8_t *sector = &victim->raw[i * SECTOR_SIZE];
+        int ret = xbox_nand_read_block(lba + i, sector, sector + 0x200);
+        if (ret)
+            ret = xbox_nand_read_block(lba + i, sector, sector + 0x200);
+        if (ret) {
+            memset(sector, 0, SECTOR_SIZE);
+            if (fuse_read_errors++ < MAX_LISTED_ERRORS)
+                LOG_WARN("FUSE: read of sector %u failed: 0x%X", lba + i, ret);
+        }
+    }
+    victim->block = block;
+    victim->used = ++fuse_clock;
+    return victim;
+}
+
+static int nf_getattr(const char *path, struct stat *st, struct fuse_file_info *fi)
+{
+    (void)fi;
+    memset(st, 0, sizeof(*st));
+
+    if (strcmp(path, "/") == 0) {
+        st->st_mode = S_IFDIR | 0755;
+        st->st_nlink = 2;
+        return 0;
+    }
+
+    const struct nand_file *f = find_file(path);
+    if (!f)
+        return -ENOENT;
+    st->st_mode = S_IFREG | 0644;
+    st->st_nlink = 1;
+    st->st_size = (off_t)fuse_sectors * f->stride;
+    st->st_blksize = fuse_spb * f->stride;
+    return 0;
+}
+
+static int nf_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t off,
+                      struct fuse_file_info *fi, enum fuse_readdir_flags flags)
+{
+    (void)off;
+    (void)fi;
+    (void)flags;
+
+    if (strcmp(path, "/") != 0)
+        return -ENOENT;
+    filler(buf, ".", NULL, 0, 0);
+    filler(buf, "..", NULL, 0, 0);
+    for (size_t i = 0; i < NAND_FILE_COUNT; i++)
+        filler(buf, nand_files[i].path + 1, NULL, 0, 0);
+    return 0;
+}
+
+static int nf_open(const char *path, struct fuse_file_info *fi)
+{
+    (void)fi;
+    return find_file(path) ? 0 : -ENOENT;
+}
+
+/* The files have a fixed size; accept truncation to that size only */
+static int nf_truncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+    (void)fi;
+    const struct nand_file *f = find_file(path);
+    if (!f)
+        return -ENOENT;
+    return size == (off_t)fuse_sectors * f->stride ? 0 : -EPERM;
+}
+
+/**
+ * Copy between a file view and the cached sectors
+ * @return Bytes transferred, negative errno on failure
+ */
+static int nf_transfer(const char *path, char *buf, size_t size, off_t off, int write)
+{
+    const struct nand_file *f = find_file(path);
+    if (!f)
+        return -ENOENT;
+
+    off_t file_size = (off_t)fuse_sectors * f->stride;
+    if (off >= file_size)
+        return write ? -ENOSPC : 0;
+    if ((off_t)size > file_size - off)
+        size = file_size - off;
+
+    size_t done = 0;
+    while (done < size) {
+        uint32_t lba = (off + done) / f->stride;
+        uint32_t within = (off + done) % f->stride;
+        uint32_t n = f->stride - within;
+        if (n > size - done)
+            n = size - done;
+
+        struct cached_block *c = get_block(lba / fuse_spb);
+        uint8_t *sector = &c->raw[(lba % fuse_spb) * SECTOR_SIZE];
+        if (write) {
+            memcpy(&sector[f->offset + within], buf + done, n);
+            if (nand_wb_write(lba, sector, sector + 0x200) != 0)
+                return -EIO;
+        } else {
+            memcpy(buf + done, &sector[f->offset + within], n);
+        }
+        done += n;
+    }
+    return done;
+}
+
+static int nf_read(const char *path, char *buf, size_t size, off_t off,
+                   struct fuse_file_info *fi)
+{
+    (void)fi;
+    return nf_transfer(path, buf, size, off, 0);
+}
+
+static int nf_write(const char *path, const char *buf, size_t size, off_t off,
+                    struct fuse_file_info *fi)
+{
+    (void)fi;
+    return nf_transfer(path, (char *)buf, size, off, 1);
+}
+
+static int nf_sync(void)
+{
+    int ret = nand_wb_sync();
+    if (ret) {
+        LOG_WARN("FUSE: write failed: 0x%X", ret);
+        return -EIO;
+    }
+    return 0;
+}
+
+static int nf_flush(const char *path, struct fuse_file_info *fi)
+{
+    (void)path;
+    (void)fi;
+    return nf_sync();
+}
+
+static int nf_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    (void)path;
+    (void)datasync;
+    (void)fi;
+    return nf_sync();
+}
+
+static void *nf_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+    (void)conn;
+    /*
+     * The data, spare and raw files are views of the same sectors, so the
+     * kernel page cache of one would go stale on writes through another.
+     * Bypass it; misses are cached per erase block here instead.
+     */
+    cfg->direct_io = 1;
+    return NULL;
+}
+
+static void nf_destroy(void *data)
+{
+    (void)data;
+    nf_sync();
+}
+
+static const struct fuse_operations nf_ops = {
+    .getattr = nf_getattr,
+    .readdir = nf_readdir,
+    .open = nf_open,
+    .truncate = nf_truncate,
+    .read = nf_read,
+    .write = nf_write,
+    .flush = nf_flush,
+    .fsync = nf_fsync,
+    .init = nf_init,
+    .destroy = nf_destroy,
+};
+
+int nand_fuse_run(const char *mountpoint, uint32_t sectors)
+{
+    const struct xbox_nand_geometry *geo = xbox_nand_get_geometry();
+
+    if (sectors > geo->sectors) {
+        LOG_ERROR("FUSE: 0x%X sectors run past the end of the NAND (0x%X)", sectors,
+                  geo->sectors);
+        return -1;
+    }
+    fuse_sectors = sectors;
+    fuse_spb = geo->sectors_per_block;
+
+    for (int i = 0; i < FUSE_CACHE_BLOCKS; i++) {
+        fuse_cache[i].block = UINT32_MAX;
+        fuse_cache[i].raw = malloc((size_t)fuse_spb * SECTOR_SIZE);
+        if (!fuse_cache[i].raw) {
+            while (i--)
+                free(fuse_cache[i].raw);
+            return -1;
+        }
+    }
+
+    /* Foreground and single-threaded: NAND access is serialized anyway */
+    char *argv[] = { "pi4flasher", "-f", "-s", "-o", "default_permissions",
+                     (char *)mountpoint, NULL };
+    LOG_INFO("FUSE: %u sectors mounted on %s", sectors, mountpoint);
+    int ret = fuse_main(6, argv, &nf_ops, NULL);
+
+    LOG_INFO("FUSE: %u erase block hits, %u misses", fuse_hits, fuse_misses);
+    if (fuse_read_errors)
+        LOG_WARN("FUSE: %u sectors failed to read and were zeroed", fuse_read_errors);
+    for (int i = 0; i < FUSE_CACHE_BLOCKS; i++)
+        free(fuse_cache[i].raw);
+    return ret ? -1 : 0;
+}
+
+#else
+
+int nand_fuse_run(const char *mountpoint, uint32_t sectors)
+{
+    (void)mountpoint;
+    (void)sectors;
+    LOG_ERROR("FUSE: not supported by this build, install libfuse3-dev and rebuild");
+    return -1;
+}
+
+#endif /* HAVE_FUSE */
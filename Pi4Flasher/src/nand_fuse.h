@@ -0,0 +1,42 @@
+/*
+ * Pi4Flasher - Xbox 360 NAND Flasher for Raspberry Pi 4
+ * Copyright (c) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+#ifndef __NAND_FUSE_H__
+#define __NAND_FUSE_H__
+
+#include <stdint.h>
+
+/*
+ * NAND filesystem (pi4flasher mount)
+ *
+ * Mounts a directory with three views of the NAND:
+ *  data   0x200 bytes per sector
+ *  spare  0x10 bytes per sector
+ *  raw    both interleaved, 0x210 bytes per sector like a J-Runner dump
+ *
+ * Reads are served from a small cache of whole erase blocks, so a miss
+ * reads ahead to the end of the erase block. Sectors that fail to read
+ * twice read as zeros. Writes patch the cached
+ * sectors and go through the write-back path (nand_wb.h); they reach the
+ * NAND when the writer moves to another erase block, on fsync or close,
+ * and at unmount. Writing data does not update the spare area.
+ *
+ * Only available when built with libfuse3 (HAVE_FUSE).
+ */
+
+/**
+ * Mount the NAND and serve requests until the filesystem is unmounted
+ * The caller stops the SMC first, as for the other offline modes.
+ * @param mountpoint Existing directory to mount on
+ * @param sectors Number of sectors exposed, at most the size of the NAND
+ * @return 0 on success, -1 on failure
+ */
+int nand_fuse_run(const char *mountpoint, uint32_t sectors);
+
+#endif /* __NAND_FUSE_H__ */
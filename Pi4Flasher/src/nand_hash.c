@@ -0,0 +1,73 @@
+/*
+ * Pi4Flasher - Xbox 360 NAND Flasher for Raspberry Pi 4
+ * Copyright (c) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+#include "nand_hash.h"
+#include "hash.h"
+#include "xbox.h"
+#include "log.h"
+
+int nand_hash_sectors(uint32_t lba, uint32_t count, uint64_t *hash)
+{
+    struct xxh64_state state;
+    uint8_t buffer[0x210];
+
+    xxh64_init(&state);
+    for (uint32_t i = 0; i < count; i++) {
+        int ret = xbox_nand_read_block(lba + i, buffer, &buffer[0x200]);
+        if (ret)
+            return ret;
+        xxh64_update(&state, buffer, sizeof(buffer));
+    }
+
+    *hash = xxh64_digest(&state);
+    return 0;
+}
+
+int nand_hash_block(uint32_t block, uint64_t *hash)
+{
+    uint32_t sectors = xbox_nand_get_geometry()->sectors_per_block;
+    return nand_hash_sectors(block * sectors, sectors, hash);
+}
+
+uint32_t nand_hash_span(uint32_t lba, uint32_t count)
+{
+    uint32_t sectors = xbox_nand_get_geometry()->sectors_per_block;
+    if (!count)
+        return 0;
+    return (lba + count - 1) / sectors - lba / sectors + 1;
+}
+
+uint32_t nand_hash_compare(uint32_t lba, uint32_t count,
+                           const uint64_t *hashes, uint32_t *diff)
+{
+    uint32_t sectors = xbox_nand_get_geometry()->sectors_per_block;
+    uint32_t end = lba + count;
+    uint32_t ndiff = 0;
+
+    while (lba < end) {
+        uint32_t block = lba / sectors;
+        uint32_t n = (block + 1) * sectors - lba;
+        if (n > end - lba)
+            n = end - lba;
+
+        uint64_t hash;
+        int ret = nand_hash_sectors(lba, n, &hash);
+        if (ret) {
+            LOG_WARN("Hash of erase block %u failed: 0x%X", block, ret);
+            diff[ndiff++] = block;
+        } else if (hash != *hashes) {
+            diff[ndiff++] = block;
+        }
+
+        hashes++;
+        lba += n;
+    }
+
+    return ndiff;
+}
@@ -0,0 +1,64 @@
+/*
+ * Pi4Flasher - Xbox 360 NAND Flasher for Raspberry Pi 4
+ * Copyright (c) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+#ifndef __NAND_HASH_H__
+#define __NAND_HASH_H__
+
+#include <stdint.h>
+
+/*
+ * Erase block hashes
+ *
+ * A block hash is XXH64 (seed 0) over the raw contents of the erase block:
+ * the 512 data bytes followed by the 16 spare bytes of every sector, in
+ * sector order. That is exactly the corresponding slice of a raw NAND image,
+ * so hosts can compute it without knowing anything about the layout.
+ */
+
+/**
+ * Hash a range of sectors as currently stored in NAND
+ * @param lba First logical block address (512-byte sector)
+ * @param count Number of sectors
+ * @param hash Receives the hash
+ * @return 0 on success, NAND error code on failure
+ */
+int nand_hash_sectors(uint32_t lba, uint32_t count, uint64_t *hash);
+
+/**
+ * Hash one erase block as currently stored in NAND
+ * @param block Erase block number
+ * @param hash Receives the block hash
+ * @return 0 on success, NAND error code on failure
+ */
+int nand_hash_block(uint32_t block, uint64_t *hash);
+
+/**
+ * Get the number of erase blocks a sector range touches
+ * @param lba First logical block address
+ * @param count Number of sectors
+ * @return Number of erase blocks, i.e. hashes nand_hash_compare() expects
+ */
+uint32_t nand_hash_span(uint32_t lba, uint32_t count);
+
+/**
+ * Find erase blocks whose contents differ from the expected hashes
+ * The range is split at erase block boundaries and each piece is hashed
+ * separately, so a range that starts or ends inside an erase block only
+ * hashes the sectors it covers. Pieces that fail to read count as
+ * differing.
+ * @param lba First logical block address
+ * @param count Number of sectors
+ * @param hashes Expected hash of each piece, nand_hash_span() entries
+ * @param diff Receives differing erase block numbers (nand_hash_span() room)
+ * @return Number of differing blocks written to diff
+ */
+uint32_t nand_hash_compare(uint32_t lba, uint32_t count,
+                           const uint64_t *hashes, uint32_t *diff);
+
+#endif /* __NAND_HASH_H__ */
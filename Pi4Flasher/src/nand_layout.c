@@ -0,0 +1,209 @@
+/*
+ * Pi4Flasher - Xbox 360 NAND Flasher for Raspberry Pi 4
+ * Copyright (c) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+#include "nand_layout.h"
+#include "xbox.h"
+#include "log.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* NAND header fields */
+#define HDR_MAGIC 0x00
+#define HDR_CB_OFFSET 0x08
+#define HDR_KV_LENGTH 0x60
+#define HDR_SYS_UPDATE 0x64
+#define HDR_KV_OFFSET 0x6C
+#define HDR_PATCH_SLOT_SIZE 0x70
+#define HDR_SMC_LENGTH 0x78
+#define HDR_SMC_OFFSET 0x7C
+
+/* Bootloader header fields */
+#define BL_MAGIC 0x00
+#define BL_SIZE 0x0C
+
+/* Sanity limits, a 512MB big block NAND holds the whole system in 64MB */
+#define LAYOUT_MAX_OFFSET 0x4000000
+#define LAYOUT_MAX_SIZE 0x100000
+#define LAYOUT_MAX_CHAIN 6
+
+static uint16_t be16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static uint32_t be32(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+/* Read len bytes at a data-only image offset */
+static int layout_read(uint32_t offset, uint8_t *dst, size_t len)
+{
+    uint8_t sector[0x210];
+
+    while (len) {
+        uint32_t pos = offset % 0x200;
+        size_t n = len < 0x200 - pos ? len : 0x200 - pos;
+
+        int ret = xbox_nand_read_block(offset / 0x200, sector, &sector[0x200]);
+        if (ret)
+            return ret;
+        memcpy(dst, &sector[pos], n);
+        dst += n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* 'CB'..'CG' retail, 'SB'..'SE' devkit and pre-Zephyr */
+static int bootloader_magic_valid(uint16_t magic)
+{
+    uint8_t kind = magic >> 8, stage = magic & 0xFF;
+    return (kind == 'C' || kind == 'S') && stage >= 'B' && stage <= 'G';
+}
+
+static void add_region(struct essential_region *regions, uint32_t *count,
+                       uint16_t type, uint16_t magic, uint32_t offset, uint32_t length)
+{
+    if (*count >= NAND_LAYOUT_MAX_REGIONS || !length ||
+        offset >= LAYOUT_MAX_OFFSET || length > LAYOUT_MAX_SIZE) {
+        LOG_DEBUG("Layout: skipping region type %u at 0x%X+0x%X", type, offset, length);
+        return;
+    }
+
+    struct essential_region *r = &regions[(*count)++];
+    r->type = type;
+    r->magic = magic;
+    r->offset = offset;
+    r->length = length;
+}
+
+/**
+ * Follow a bootloader chain, each header's size leads to the next one
+ * @return 0 or NAND error code
+ */
+static int walk_chain(uint32_t offset, struct essential_region *regions, uint32_t *count)
+{
+    for (int i = 0; i < LAYOUT_MAX_CHAIN && offset < LAYOUT_MAX_OFFSET; i++) {
+        uint8_t hdr[0x10];
+        int ret = layout_read(offset, hdr, sizeof(hdr));
+        if (ret)
+            return ret;
+
+        uint16_t magic = be16(&hdr[BL_MAGIC]);
+        uint32_t size = be32(&hdr[BL_SIZE]);
+        if (!bootloader_magic_valid(magic) || size < sizeof(hdr) || size > LAYOUT_MAX_SIZE)
+            break;
+
+        add_region(regions, count, ESSENTIAL_BOOTLOADER, magic, offset, size);
+        offset += (size + 0xF) & ~0xFu;
+    }
+    return 0;
+}
+
+int nand_layout_essentials(struct essential_region *regions, uint32_t *count)
+{
+    uint8_t hdr[0x80];
+    int ret;
+
+    *count = 0;
+    ret = layout_read(0, hdr, sizeof(hdr));
+    if (ret)
+        return ret;
+
+    /* 0xFF4F retail, 0x0F4F devkit */
+    if ((be16(&hdr[HDR_MAGIC]) & 0x0FFF) != 0x0F4F) {
+        LOG_WARN("Layout: no NAND header (magic 0x%04X)", be16(&hdr[HDR_MAGIC]));
+        return -1;
+    }
+
+    add_region(regions, count, ESSENTIAL_HEADER, be16(&hdr[HDR_MAGIC]), 0, 0x200);
+    add_region(regions, count, ESSENTIAL_SMC, 0,
+               be32(&hdr[HDR_SMC_OFFSET]), be32(&hdr[HDR_SMC_LENGTH]));
+    add_region(regions, count, ESSENTIAL_KEYVAULT, 0,
+               be32(&hdr[HDR_KV_OFFSET]), be32(&hdr[HDR_KV_LENGTH]));
+
+    ret = walk_chain(be32(&hdr[HDR_CB_OFFSET]), regions, count);
+    if (ret)
+        return ret;
+
+    uint32_t sys_update = be32(&hdr[HDR_SYS_UPDATE]);
+    uint32_t slot_size = be32(&hdr[HDR_PATCH_SLOT_SIZE]);
+    /* Two patch slots; an empty slot stops at the magic check */
+    for (uint32_t i = 0; sys_update && i < (slot_size ? 2u : 1u); i++) {
+        ret = walk_chain(sys_update + i * slot_size, regions, count);
+        if (ret)
+            return ret;
+    }
+
+    LOG_INFO("Layout: %u essential regions", *count);
+    return 0;
+}
+
+static int span_cmp(const void *a, const void *b)
+{
+    const struct nand_span *x = a, *y = b;
+    return x->start < y->start ? -1 : x->start > y->start;
+}
+
+uint32_t nand_layout_spans(const struct essential_region *regions, uint32_t count,
+                           struct nand_span *spans)
+{
+    uint32_t n = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        spans[i].start = regions[i].offset / 0x200;
+        spans[i].end = (regions[i].offset + regions[i].length + 0x1FF) / 0x200;
+    }
+    qsort(spans, count, sizeof(*spans), span_cmp);
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (n && spans[i].start <= spans[n - 1].end) {
+            if (spans[i].end > spans[n - 1].end)
+                spans[n - 1].end = spans[i].end;
+        } else {
+            spans[n++] = spans[i];
+        }
+    }
+    return n;
+}
+
+uint32_t nand_layout_remap(uint32_t blocks, uint32_t *map, uint32_t *unrepaired)
+{
+    uint32_t sectors = xbox_nand_get_geometry()->sectors_per_block;
+    uint32_t user = blocks - NAND_LAYOUT_RESERVE_BLOCKS;
+    uint32_t remapped = 0;
+    uint8_t spare[0x10];
+
+    /* An unreadable spare area is treated like a bad block marker */
+    *unrepaired = 0;
+    for (uint32_t b = 0; b < user; b++) {
+        int bad = xbox_nand_read_spare(b * sectors, spare) != 0 || xbox_spare_is_bad(spare);
+        map[b] = bad ? UINT32_MAX : b;
+    }
+
+    for (uint32_t r = blocks; r-- > user;) {
+        if (xbox_nand_read_spare(r * sectors, spare) != 0 || xbox_spare_is_bad(spare))
+            continue;
+        uint32_t id = xbox_spare_block_id(spare);
+        if (id < user && map[id] == UINT32_MAX) {
+            map[id] = r;
+            remapped++;
+        }
+    }
+
+    for (uint32_t b = 0; b < user; b++) {
+        if (map[b] == UINT32_MAX) {
+            map[b] = b;
+            (*unrepaired)++;
+        }
+    }
+    return remapped;
+}
@@ -0,0 +1,76 @@
+/*
+ * Pi4Flasher - Xbox 360 NAND Flasher for Raspberry Pi 4
+ * Copyright (c) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+#ifndef __NAND_LAYOUT_H__
+#define __NAND_LAYOUT_H__
+
+#include <stdint.h>
+#include "protocol.h"
+
+/*
+ * NAND image layout
+ *
+ * The NAND header in the first sector (big-endian) points at the SMC, the
+ * keyvault, the CB/CD/CE bootloader chain and the CF/CG patch slots. Offsets
+ * are in the data-only image, so byte offset / 0x200 is the sector. Bad
+ * block remapping is not taken into account.
+ *
+ * The last NAND_LAYOUT_RESERVE_BLOCKS erase blocks of the image area hold
+ * replacements for bad blocks before them; a replacement carries the number
+ * of the block it replaces in its spare area.
+ */
+
+/* Largest number of regions nand_layout_essentials() reports */
+#define NAND_LAYOUT_MAX_REGIONS 16
+
+/* Erase blocks at the end of the image area reserved for remapping */
+#define NAND_LAYOUT_RESERVE_BLOCKS 0x20
+
+/* One run of sectors [start, end) */
+struct nand_span {
+    uint32_t start;
+    uint32_t end;
+};
+
+/**
+ * Locate the regions needed to rebuild an image: header, SMC, keyvault and
+ * every bootloader of the chain and the patch slots
+ * @param regions Receives up to NAND_LAYOUT_MAX_REGIONS regions
+ * @param count Receives the number of regions found
+ * @return 0 on success, NAND error code on a failed read, -1 if sector 0 does
+ *         not hold a NAND header
+ */
+int nand_layout_essentials(struct essential_region *regions, uint32_t *count);
+
+/**
+ * Turn regions into the ascending, non-overlapping sector runs covering them
+ * @param regions Regions from nand_layout_essentials()
+ * @param count Number of regions
+ * @param spans Receives up to count runs
+ * @return Number of runs
+ */
+uint32_t nand_layout_spans(const struct essential_region *regions, uint32_t count,
+                           struct nand_span *spans);
+
+/**
+ * Build the bad block remap table of an image area from the spare areas of
+ * its erase blocks
+ * If several good reserve blocks carry the same block number, the one
+ * nearest the end of the area is used. A bad block without a replacement
+ * maps to itself.
+ * @param blocks Erase blocks of the image area, reserve included, more than
+ *               NAND_LAYOUT_RESERVE_BLOCKS
+ * @param map Receives blocks - NAND_LAYOUT_RESERVE_BLOCKS entries, the
+ *            physical erase block holding each logical block
+ * @param unrepaired Receives the number of bad blocks without replacement
+ * @return Number of remapped blocks
+ */
+uint32_t nand_layout_remap(uint32_t blocks, uint32_t *map, uint32_t *unrepaired);
+
+#endif /* __NAND_LAYOUT_H__ */
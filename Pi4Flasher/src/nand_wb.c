@@ -0,0 +1,370 @@
+/*
+ * Pi4Flasher - Xbox 360 NAND Flasher for Raspberry Pi 4
+ * Copyright (c) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+#include "nand_wb.h"
+#include "xbox.h"
+#include "dump_cache.h"
+#include "log.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Largest erase block (0x40000) in 512-byte sectors */
+#define WB_MAX_SECTORS (0x40000 / 0x200)
+#define WB_SECTOR_SIZE 0x210
+
+/* Flush the buffered block after the link has been idle this long */
+#define WB_IDLE_TIMEOUT_NS 250000000ull
+
+#define WB_NO_BLOCK 0xFFFFFFFF
+
+/* One erase block worth of sectors */
+struct wb_buffer {
+    uint8_t *data;
+    uint8_t valid[WB_MAX_SECTORS / 8];
+    uint32_t block;     /* first lba of buffered block */
+    uint32_t count;     /* sectors written by the host */
+};
+
+/*
+ * Double buffering: the command loop fills one buffer while the flush
+ * thread erases and programs the other, so NAND busy time overlaps with
+ * the host sending the next erase block.
+ */
+static struct wb_buffer buffers[2];
+static struct wb_buffer *wb_fill = &buffers[0];     /* command loop */
+static struct wb_buffer *wb_busy;                   /* flush thread */
+
+static pthread_t wb_thread;
+static pthread_mutex_t wb_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wb_cond = PTHREAD_COND_INITIALIZER;
+static int wb_stop;
+static int wb_error;                /* failed flush not yet reported */
+static uint32_t wb_error_block;     /* first sector of the block that failed */
+static uint64_t wb_last_write_ns;
+
+/* Statistics, updated by the flush thread */
+static uint32_t wb_blocks_flushed;
+static uint32_t wb_erases_skipped;
+
+/*
+ * Blank checks before erasing. A check reads only the spare area of each
+ * page; on a large block it can still take as long as the erase it saves,
+ * so after a few blocks the time spent is weighed against the erase time
+ * saved, and checking stops if it does not pay.
+ */
+#define WB_BLANK_CHECK_TRIAL 8
+
+static uint32_t wb_blank_checks;
+static uint64_t wb_blank_check_ns;
+static int wb_blank_check_off;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Check that every page of the buffered erase block is erased on the NAND
+ * A programmed page always carries its block number and EDC in the spare,
+ * so a page whose spare is all 0xFF is erased; only the spare areas of the
+ * sectors the host wrote are read. Sectors read back for preservation are
+ * already in the buffer and are checked there in full. Stops at the first
+ * page that is not blank.
+ * @return 1 if the block is erased, 0 otherwise
+ */
+static int wb_block_is_blank(const struct wb_buffer *buf, uint32_t sectors)
+{
+    uint8_t spare[0x10];
+
+    for (uint32_t i = 0; i < sectors; i++) {
+        const uint8_t *page = &buf->data[i * WB_SECTOR_SIZE];
+
+        if (buf->valid[i / 8] & (1 << (i % 8))) {
+            if (xbox_nand_read_spare(buf->block + i, spare) ||
+                !xbox_buffer_is_blank(spare, sizeof(spare)))
+                return 0;
+        } else if (!xbox_buffer_is_blank(page, WB_SECTOR_SIZE)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Stop checking when the checks have cost more than the erases they saved */
+static void wb_blank_check_review(void)
+{
+    if (wb_blank_checks < WB_BLANK_CHECK_TRIAL)
+        return;
+
+    uint64_t erase_ns = xbox_nand_expected_ns(XBOX_NAND_OP_ERASE);
+    uint64_t saved_ns = wb_erases_skipped * erase_ns;
+    if (wb_blank_check_ns <= saved_ns)
+        return;
+
+    wb_blank_check_off = 1;
+    LOG_INFO("Write-back: blank checks took %llu us for %u erases skipped (tBERS %llu us), "
+             "always erasing from now on",
+             (unsigned long long)(wb_blank_check_ns / 1000), wb_erases_skipped,
+             (unsigned long long)(erase_ns / 1000));
+}
+
+static int wb_buffer_flush(struct wb_buffer *buf)
+{
+    uint32_t sectors = xbox_nand_get_geometry()->sectors_per_block;
+    uint32_t block = buf->block;
+    int ret = 0;
+
+    /* Preserve sectors the host did not write */
+    for (uint32_t i = 0; i < sectors && buf->count < sectors; i++) {
+        if (buf->valid[i / 8] & (1 << (i % 8)))
+            continue;
+
+        uint8_t *sector = &buf->data[i * WB_SECTOR_SIZE];
+        ret = xbox_nand_read_block(block + i, sector, sector + 0x200);
+        if (ret) {
+            LOG_WARN("Write-back: read-back of block %u failed: 0x%X", block + i, ret);
+            goto out;
+        }
+    }
+
+    /* Freshly erased NAND does not need another erase pass */
+    int blank = 0;
+    if (!wb_blank_check_off) {
+        uint64_t start = now_ns();
+        blank = wb_block_is_blank(buf, sectors);
+        wb_blank_check_ns += now_ns() - start;
+        wb_blank_checks++;
+        if (blank)
+            wb_erases_skipped++;
+        wb_blank_check_review();
+    }
+    if (!blank) {
+        ret = xbox_nand_erase_block(block);
+        if (ret) {
+            LOG_WARN("Write-back: erase at block %u failed: 0x%X", block, ret);
+            goto out;
+        }
+    }
+    wb_blocks_flushed++;
+
+    for (uint32_t i = 0; i < sectors; i++) {
+        uint8_t *sector = &buf->data[i * WB_SECTOR_SIZE];
+
+        /* Programming all 0xFF leaves an erased page unchanged */
+        if (xbox_buffer_is_blank(sector, WB_SECTOR_SIZE))
+            continue;
+
+        ret = xbox_nand_program_block(block + i, sector, sector + 0x200);
+        if (ret) {
+            LOG_WARN("Write-back: program of block %u failed: 0x%X", block + i, ret);
+            goto out;
+        }
+    }
+
+    LOG_DEBUG("Write-back: flushed erase block at %u (%u/%u sectors from host)",
+              block, buf->count, sectors);
+
+out:
+    memset(buf->valid, 0, sizeof(buf->valid));
+    buf->count = 0;
+    buf->block = WB_NO_BLOCK;
+    return ret;
+}
+
+static void *wb_thread_main(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&wb_lock);
+    for (;;) {
+        while (!wb_busy && !wb_stop)
+            pthread_cond_wait(&wb_cond, &wb_lock);
+        if (!wb_busy)
+            break;
+
+        struct wb_buffer *buf = wb_busy;
+        uint32_t block = buf->block;
+        pthread_mutex_unlock(&wb_lock);
+
+        int ret = wb_buffer_flush(buf);
+
+        pthread_mutex_lock(&wb_lock);
+        if (ret && !wb_error) {
+            wb_error = ret;
+            wb_error_block = block;
+        }
+        wb_busy = NULL;
+        pthread_cond_broadcast(&wb_cond);
+    }
+    pthread_mutex_unlock(&wb_lock);
+    return NULL;
+}
+
+/* Called with wb_lock held */
+static void wb_wait_idle(void)
+{
+    while (wb_busy)
+        pthread_cond_wait(&wb_cond, &wb_lock);
+}
+
+/**
+ * Hand the fill buffer to the flush thread and continue with the other one
+ * Called with wb_lock held.
+ */
+static void wb_submit(void)
+{
+    if (wb_fill->block == WB_NO_BLOCK)
+        return;
+
+    wb_wait_idle();
+    wb_busy = wb_fill;
+    wb_fill = wb_fill == &buffers[0] ? &buffers[1] : &buffers[0];
+    pthread_cond_broadcast(&wb_cond);
+}
+
+int nand_wb_init(void)
+{
+    for (int i = 0; i < 2; i++) {
+        buffers[i].data = malloc(WB_MAX_SECTORS * WB_SECTOR_SIZE);
+        buffers[i].block = WB_NO_BLOCK;
+        if (!buffers[i].data) {
+            LOG_ERROR("Failed to allocate write-back buffer");
+            goto fail;
+        }
+    }
+
+    if (pthread_create(&wb_thread, NULL, wb_thread_main, NULL) != 0) {
+        LOG_ERROR("Failed to start write-back thread");
+        goto fail;
+    }
+    return 0;
+
+fail:
+    /* nand_wb_deinit() relies on buffers[0].data to tell if init succeeded */
+    for (int i = 0; i < 2; i++) {
+        free(buffers[i].data);
+        buffers[i].data = NULL;
+    }
+    return -1;
+}
+
+void nand_wb_deinit(void)
+{
+    if (!buffers[0].data)
+        return;
+
+    int ret = nand_wb_sync();
+    if (ret)
+        LOG_WARN("Write-back: final flush failed: 0x%X", ret);
+
+    pthread_mutex_lock(&wb_lock);
+    wb_stop = 1;
+    pthread_cond_broadcast(&wb_cond);
+    pthread_mutex_unlock(&wb_lock);
+    pthread_join(wb_thread, NULL);
+
+    for (int i = 0; i < 2; i++) {
+        free(buffers[i].data);
+        buffers[i].data = NULL;
+    }
+}
+
+int nand_wb_write(uint32_t lba, const uint8_t *buffer, const uint8_t *spare)
+{
+    uint32_t sectors = xbox_nand_get_geometry()->sectors_per_block;
+    uint32_t block = lba - lba % sectors;
+
+    dump_cache_invalidate(lba);
+
+    pthread_mutex_lock(&wb_lock);
+
+    int ret = wb_error;
+    wb_error = 0;
+
+    if (block != wb_fill->block) {
+        wb_submit();
+        wb_fill->block = block;
+    }
+
+    uint32_t i = lba - block;
+    uint8_t *sector = &wb_fill->data[i * WB_SECTOR_SIZE];
+    memcpy(sector, buffer, 0x200);
+    memcpy(sector + 0x200, spare, 0x10);
+
+    if (!(wb_fill->valid[i / 8] & (1 << (i % 8)))) {
+        wb_fill->valid[i / 8] |= 1 << (i % 8);
+        wb_fill->count++;
+    }
+    wb_last_write_ns = now_ns();
+
+    /* A complete block has nothing left to wait for */
+    if (wb_fill->count == sectors)
+        wb_submit();
+
+    pthread_mutex_unlock(&wb_lock);
+    return ret;
+}
+
+int nand_wb_sync(void)
+{
+    pthread_mutex_lock(&wb_lock);
+    wb_submit();
+    wb_wait_idle();
+
+    int ret = wb_error;
+    wb_error = 0;
+    pthread_mutex_unlock(&wb_lock);
+    return ret;
+}
+
+uint32_t nand_wb_error_block(void)
+{
+    pthread_mutex_lock(&wb_lock);
+    uint32_t block = wb_error_block;
+    pthread_mutex_unlock(&wb_lock);
+    return block;
+}
+
+void nand_wb_flush(void)
+{
+    pthread_mutex_lock(&wb_lock);
+    wb_submit();
+    wb_wait_idle();
+    pthread_mutex_unlock(&wb_lock);
+}
+
+void nand_wb_poll(void)
+{
+    pthread_mutex_lock(&wb_lock);
+    if (wb_fill->block != WB_NO_BLOCK &&
+        now_ns() - wb_last_write_ns >= WB_IDLE_TIMEOUT_NS)
+        wb_submit();
+    pthread_mutex_unlock(&wb_lock);
+}
+
+void nand_wb_report(void)
+{
+    pthread_mutex_lock(&wb_lock);
+    wb_wait_idle();
+    if (wb_blocks_flushed)
+        LOG_INFO("Write-back: %u erase blocks written, %u erases skipped (already blank)",
+                 wb_blocks_flushed, wb_erases_skipped);
+    if (wb_blank_checks) {
+        uint64_t erase_ns = xbox_nand_expected_ns(XBOX_NAND_OP_ERASE);
+        LOG_INFO("Write-back: %u blank checks took %llu us, saved %llu us (tBERS %llu us)",
+                 wb_blank_checks, (unsigned long long)(wb_blank_check_ns / 1000),
+                 (unsigned long long)(wb_erases_skipped * erase_ns / 1000),
+                 (unsigned long long)(erase_ns / 1000));
+    }
+    pthread_mutex_unlock(&wb_lock);
+}
@@ -0,0 +1,83 @@
+/*
+ * Pi4Flasher - Xbox 360 NAND Flasher for Raspberry Pi 4
+ * Copyright (c) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+#ifndef __NAND_WB_H__
+#define __NAND_WB_H__
+
+#include <stdint.h>
+
+/*
+ * Erase-block write coalescing.
+ *
+ * Sector writes are collected per erase block. When the block changes, on
+ * an explicit sync or after the link has been idle for a while, the block
+ * is erased once and programmed in order. Sectors of the block that were
+ * not written are read back first so partial writes never lose data, and
+ * the erase is skipped when a blank check shows the block is still erased.
+ *
+ * Flushing runs on a separate thread with double buffering, so erasing and
+ * programming block N overlaps with the host sending block N+1. The flush
+ * thread owns the NAND while it runs: any other NAND access must be
+ * preceded by nand_wb_flush() or nand_wb_sync().
+ */
+
+/**
+ * Allocate the write-back buffer for the largest supported erase block
+ * @return 0 on success, -1 on failure
+ */
+int nand_wb_init(void);
+
+/**
+ * Flush pending data and free the write-back buffer
+ */
+void nand_wb_deinit(void);
+
+/**
+ * Queue a sector write
+ * May flush the previously buffered erase block first.
+ * @param lba Logical block address (512-byte sector)
+ * @param buffer 512 bytes of data
+ * @param spare 16 bytes of spare/ECC data
+ * @return 0 on success, error code of a failed earlier flush otherwise
+ */
+int nand_wb_write(uint32_t lba, const uint8_t *buffer, const uint8_t *spare);
+
+/**
+ * Erase and program the buffered erase block and wait for all flushes
+ * @return 0 on success, error code on failure
+ */
+int nand_wb_sync(void);
+
+/**
+ * Get the erase block of the last failure returned by nand_wb_write() or
+ * nand_wb_sync(). Only one flush completes between two calls, so each
+ * failure names the block it came from.
+ * @return First sector of the erase block
+ */
+uint32_t nand_wb_error_block(void);
+
+/**
+ * Erase and program the buffered erase block and wait for all flushes
+ * Use before any other NAND access. A failure is kept and returned by the next nand_wb_write() or
+ * nand_wb_sync(), so the host that wrote the data still sees it.
+ */
+void nand_wb_flush(void);
+
+/**
+ * Start flushing the buffered erase block if no write arrived within the
+ * timeout. Call periodically from the main loop.
+ */
+void nand_wb_poll(void);
+
+/**
+ * Log erase blocks written and erases skipped because the block was blank
+ */
+void nand_wb_report(void);
+
+#endif /* __NAND_WB_H__ */
@@ -0,0 +1,432 @@
+/*
+ * Pi4Flasher - Xbox 360 NAND Flasher for Raspberry Pi 4
+ * Copyright (c) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+#include "offline.h"
+#include "hash.h"
+#include "xbox.h"
+#include "nand_wb.h"
+#include "nand_hash.h"
+#include "log.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SECTOR_SIZE 0x210
+#define PROGRESS_INTERVAL_MS 250
+#define MAX_LISTED_ERRORS 64
+#define REPORT_BLOCKS_PER_LINE 64
+
+/* Per erase block result of offline_flash() */
+#define BLOCK_UNCHANGED '.'     /* already matched the image */
+#define BLOCK_PENDING '-'       /* differs, not written (cancelled) */
+#define BLOCK_WRITTEN 'W'       /* written, and verified if requested */
+#define BLOCK_FAILED 'X'        /* write failed, or bad after writing */
+
+struct progress {
+    const char *what;
+    uint64_t start_ms;
+    uint64_t last_ms;
+    uint32_t total;
+};
+
+/*
+ * Erase blocks are hashed on a second thread while the main thread keeps
+ * reading: the reader publishes how many sectors are in the mapping and the
+ * hasher follows one erase block behind.
+ */
+struct dump_hasher {
+    const uint8_t *image;
+    uint32_t sectors;
+    uint32_t sectors_per_block;
+    uint64_t *hashes;
+    uint32_t hashed;            /* erase blocks hashed */
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t ready;             /* sectors read, protected by lock */
+    int done;                   /* no more sectors will be read */
+};
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void progress_start(struct progress *p, const char *what, uint32_t total)
+{
+    p->what = what;
+    p->start_ms = now_ms();
+    p->last_ms = 0;
+    p->total = total;
+}
+
+/* Progress line on stdout, rewritten in place at most every 250 ms */
+static void progress_update(struct progress *p, uint32_t done)
+{
+    uint64_t now = now_ms();
+    if (done < p->total && now - p->last_ms < PROGRESS_INTERVAL_MS)
+        return;
+    p->last_ms = now;
+
+    double secs = (now - p->start_ms) / 1000.0;
+    double rate = secs > 0 ? done / secs : 0;
+    uint32_t eta = rate > 0 ? (uint32_t)((p->total - done) / rate) : 0;
+
+    printf("\r%s: %3u%% %u/%u sectors, %.1f KB/s, ETA %u:%02u ",
+           p->what, p->total ? (uint32_t)((uint64_t)done * 100 / p->total) : 100,
+           done, p->total, rate * SECTOR_SIZE / 1024, eta / 60, eta % 60);
+    if (done == p->total)
+        printf("\n");
+    fflush(stdout);
+}
+
+static void *hasher_main(void *arg)
+{
+    struct dump_hasher *h = arg;
+    uint32_t blocks = (h->sectors + h->sectors_per_block - 1) / h->sectors_per_block;
+
+    for (uint32_t b = 0; b < blocks; b++) {
+        uint32_t start = b * h->sectors_per_block;
+        uint32_t end = start + h->sectors_per_block;
+        if (end > h->sectors)
+            end = h->sectors;
+
+        pthread_mutex_lock(&h->lock);
+        while (h->ready < end && !h->done)
+            pthread_cond_wait(&h->cond, &h->lock);
+        int complete = h->ready >= end;
+        pthread_mutex_unlock(&h->lock);
+        if (!complete)
+            break;
+
+        h->hashes[b] = xxh64(&h->image[(size_t)start * SECTOR_SIZE],
+                             (size_t)(end - start) * SECTOR_SIZE);
+        h->hashed = b + 1;
+    }
+    return NULL;
+}
+
+static void hasher_publish(struct dump_hasher *h, uint32_t ready, int done)
+{
+    pthread_mutex_lock(&h->lock);
+    h->ready = ready;
+    h->done = done;
+    pthread_cond_signal(&h->cond);
+    pthread_mutex_unlock(&h->lock);
+}
+
+static int write_hashes(const char *path, const uint64_t *hashes, uint32_t count)
+{
+    char name[4096];
+    snprintf(name, sizeof(name), "%s.xxh64", path);
+
+    FILE *f = fopen(name, "w");
+    if (!f) {
+        LOG_ERROR("Dump: cannot create %s: %s", name, strerror(errno));
+        return -1;
+    }
+    for (uint32_t b = 0; b < count; b++)
+        fprintf(f, "%u %016llx\n", b, (unsigned long long)hashes[b]);
+    if (fclose(f) != 0) {
+        LOG_ERROR("Dump: cannot write %s: %s", name, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* Create the output file at its final size and map it */
+static uint8_t *map_output(const char *path, size_t size, int *fd)
+{
+    *fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (*fd < 0) {
+        LOG_ERROR("Dump: cannot create %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    /* Reserve the blocks up front so the dump cannot fail half way for lack
+     * of space; file systems without fallocate get a sparse file */
+    int ret = posix_fallocate(*fd, 0, size);
+    if (ret == EOPNOTSUPP || ret == EINVAL)
+        ret = ftruncate(*fd, size) ? errno : 0;
+    if (ret) {
+        LOG_ERROR("Dump: cannot allocate %zu bytes for %s: %s", size, path, strerror(ret));
+        close(*fd);
+        return NULL;
+    }
+
+    uint8_t *image = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+    if (image == MAP_FAILED) {
+        LOG_ERROR("Dump: cannot map %s: %s", path, strerror(errno));
+        close(*fd);
+        return NULL;
+    }
+    madvise(image, size, MADV_SEQUENTIAL);
+    return image;
+}
+
+int offline_dump(const char *path, uint32_t sectors, volatile int *running)
+{
+    size_t size = (size_t)sectors * SECTOR_SIZE;
+    uint32_t errors = 0;
+    int fd;
+
+    if (!sectors)
+        return -1;
+
+    uint8_t *image = map_output(path, size, &fd);
+    if (!image)
+        return -1;
+
+    struct dump_hasher h;
+    memset(&h, 0, sizeof(h));
+    h.image = image;
+    h.sectors = sectors;
+    h.sectors_per_block = xbox_nand_get_geometry()->sectors_per_block;
+    h.hashes = calloc((sectors + h.sectors_per_block - 1) / h.sectors_per_block,
+                      sizeof(uint64_t));
+    pthread_mutex_init(&h.lock, NULL);
+    pthread_cond_init(&h.cond, NULL);
+
+    pthread_t thread;
+    int threaded = h.hashes && pthread_create(&thread, NULL, hasher_main, &h) == 0;
+    if (!threaded)
+        LOG_WARN("Dump: hashing thread unavailable, no block hashes written");
+
+    LOG_INFO("Dump: %u sectors to %s", sectors, path);
+
+    struct progress p;
+    progress_start(&p, "Dump", sectors);
+
+    uint32_t lba;
+    for (lba = 0; lba < sectors && *running; lba++) {
+        uint8_t *sector = &image[(size_t)lba * SECTOR_SIZE];
+        int ret = xbox_nand_read_block(lba, sector, &sector[0x200]);
+        if (ret)
+            ret = xbox_nand_read_block(lba, sector, &sector[0x200]);
+        if (ret) {
+            memset(sector, 0, SECTOR_SIZE);
+            if (errors++ < MAX_LISTED_ERRORS)
+                LOG_WARN("Dump: read of block %u failed: 0x%X", lba, ret);
+        }
+
+        /* Hand over whole erase blocks, waking the hasher once per block */
+        if ((lba + 1) % h.sectors_per_block == 0)
+            hasher_publish(&h, lba + 1, 0);
+        progress_update(&p, lba + 1);
+    }
+    hasher_publish(&h, lba, 1);
+    if (threaded)
+        pthread_join(thread, NULL);
+
+    int ret = 0;
+    if (lba < sectors) {
+        printf("\n");
+        LOG_WARN("Dump: cancelled after %u of %u sectors", lba, sectors);
+        ret = -1;
+    }
+    if (errors) {
+        LOG_ERROR("Dump: %u sectors failed to read", errors);
+        ret = -1;
+    }
+
+    if (msync(image, size, MS_SYNC) != 0) {
+        LOG_ERROR("Dump: cannot write %s: %s", path, strerror(errno));
+        ret = -1;
+    }
+    munmap(image, size);
+    close(fd);
+
+    if (threaded && h.hashed && write_hashes(path, h.hashes, h.hashed) != 0)
+        ret = -1;
+
+    double secs = (now_ms() - p.start_ms) / 1000.0;
+    LOG_INFO("Dump: %u sectors in %.1f s (%.1f KB/s), %u erase blocks hashed",
+             lba, secs, secs > 0 ? lba * (double)SECTOR_SIZE / 1024 / secs : 0,
+             h.hashed);
+    xbox_nand_timing_report();
+
+    free(h.hashes);
+    pthread_cond_destroy(&h.cond);
+    pthread_mutex_destroy(&h.lock);
+    return ret;
+}
+
+/* Print the per erase block result map, REPORT_BLOCKS_PER_LINE per line */
+static void print_block_map(const char *map, uint32_t blocks)
+{
+    printf("Erase blocks: %c unchanged, %c written, %c failed, %c not written\n",
+           BLOCK_UNCHANGED, BLOCK_WRITTEN, BLOCK_FAILED, BLOCK_PENDING);
+    for (uint32_t b = 0; b < blocks; b += REPORT_BLOCKS_PER_LINE) {
+        uint32_t n = blocks - b < REPORT_BLOCKS_PER_LINE ? blocks - b : REPORT_BLOCKS_PER_LINE;
+        printf("%5u  %.*s\n", b, (int)n, &map[b]);
+    }
+}
+
+/* Check whether a sector range in NAND matches the image */
+static int range_matches(const uint8_t *image, uint32_t lba, uint32_t count)
+{
+    uint64_t hash;
+    if (nand_hash_sectors(lba, count, &hash) != 0)
+        return 0;
+    return hash == xxh64(&image[(size_t)lba * SECTOR_SIZE], (size_t)count * SECTOR_SIZE);
+}
+
+/* Mark the erase block of a failed write-back flush in the map */
+static void write_failed(char *map, uint32_t spb, int ret, uint32_t *errors, uint32_t *written)
+{
+    uint32_t b = nand_wb_error_block() / spb;
+
+    if ((*errors)++ < MAX_LISTED_ERRORS)
+        LOG_WARN("Flash: write of block %u failed: 0x%X", b, ret);
+    if (map[b] == BLOCK_WRITTEN)
+        (*written)--;
+    map[b] = BLOCK_FAILED;
+}
+
+int offline_flash(const char *path, int verify, volatile int *running)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        LOG_ERROR("Flash: cannot open %s: %s", path, strerror(errno));
+        return -1;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size == 0 || st.st_size % SECTOR_SIZE ||
+        st.st_size / SECTOR_SIZE > UINT32_MAX) {
+        LOG_ERROR("Flash: %s is not a raw image of 0x%X-byte sectors", path, SECTOR_SIZE);
+        close(fd);
+        return -1;
+    }
+
+    /* Nothing past the end of the part may be erased or programmed */
+    const struct xbox_nand_geometry *geo = xbox_nand_get_geometry();
+    if (st.st_size / SECTOR_SIZE > geo->sectors) {
+        LOG_ERROR("Flash: %s has 0x%llX sectors, the NAND only 0x%X", path,
+                  (unsigned long long)(st.st_size / SECTOR_SIZE), geo->sectors);
+        close(fd);
+        return -1;
+    }
+
+    size_t size = st.st_size;
+    const uint8_t *image = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (image == MAP_FAILED) {
+        LOG_ERROR("Flash: cannot map %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    madvise((void *)image, size, MADV_SEQUENTIAL);
+
+    uint32_t sectors = size / SECTOR_SIZE;
+    uint32_t spb = geo->sectors_per_block;
+    uint32_t blocks = (sectors + spb - 1) / spb;
+    char *map = malloc(blocks);
+    uint32_t unchanged = 0, changed = 0, written = 0, failed = 0, write_errors = 0;
+    uint64_t start_ms = now_ms();
+    struct progress p;
+
+    if (!map) {
+        munmap((void *)image, size);
+        close(fd);
+        return -1;
+    }
+    LOG_INFO("Flash: %u sectors from %s", sectors, path);
+
+    /* Compare first so unchanged blocks are neither erased nor programmed */
+    progress_start(&p, "Compare", sectors);
+    uint32_t b;
+    for (b = 0; b < blocks && *running; b++) {
+        uint32_t lba = b * spb;
+        uint32_t n = sectors - lba < spb ? sectors - lba : spb;
+        if (range_matches(image, lba, n)) {
+            map[b] = BLOCK_UNCHANGED;
+            unchanged++;
+        } else {
+            map[b] = BLOCK_PENDING;
+            changed += n;
+        }
+        progress_update(&p, lba + n);
+    }
+    for (; b < blocks; b++)
+        map[b] = BLOCK_PENDING;
+
+    /* Write through the write-back path: its flush thread erases and
+     * programs one block while the next is queued */
+    progress_start(&p, "Flash", changed);
+    uint32_t done = 0;
+    for (b = 0; b < blocks && *running && changed; b++) {
+        if (map[b] != BLOCK_PENDING)
+            continue;
+        uint32_t lba = b * spb;
+        uint32_t end = sectors - lba < spb ? sectors : lba + spb;
+        for (; lba < end; lba++) {
+            const uint8_t *sector = &image[(size_t)lba * SECTOR_SIZE];
+            int ret = nand_wb_write(lba, sector, &sector[0x200]);
+            if (ret)
+                write_failed(map, spb, ret, &write_errors, &written);
+            progress_update(&p, ++done);
+        }
+        map[b] = BLOCK_WRITTEN;
+        written++;
+    }
+    /* Also completes a block interrupted by cancelling */
+    int ret = nand_wb_sync();
+    if (ret)
+        write_failed(map, spb, ret, &write_errors, &written);
+
+    if (verify && written) {
+        progress_start(&p, "Verify", changed);
+        done = 0;
+        for (b = 0; b < blocks && *running; b++) {
+            if (map[b] != BLOCK_WRITTEN)
+                continue;
+            uint32_t lba = b * spb;
+            uint32_t n = sectors - lba < spb ? sectors - lba : spb;
+            if (!range_matches(image, lba, n)) {
+                map[b] = BLOCK_FAILED;
+                failed++;
+            }
+            done += n;
+            progress_update(&p, done);
+        }
+    }
+
+    if (!*running)
+        printf("\n");
+    print_block_map(map, blocks);
+
+    double secs = (now_ms() - start_ms) / 1000.0;
+    LOG_INFO("Flash: %u erase blocks, %u unchanged, %u written, %u failed verify in %.1f s",
+             blocks, unchanged, written, failed, secs);
+    nand_wb_report();
+    xbox_nand_timing_report();
+
+    ret = 0;
+    if (!*running) {
+        LOG_WARN("Flash: cancelled, blocks marked %c were not written", BLOCK_PENDING);
+        ret = -1;
+    }
+    if (write_errors || failed) {
+        LOG_ERROR("Flash: %u write errors, %u blocks failed verify", write_errors, failed);
+        ret = -1;
+    }
+
+    free(map);
+    munmap((void *)image, size);
+    close(fd);
+    return ret;
+}
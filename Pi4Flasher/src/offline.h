@@ -0,0 +1,54 @@
+/*
+ * Pi4Flasher - Xbox 360 NAND Flasher for Raspberry Pi 4
+ * Copyright (c) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+#ifndef __OFFLINE_H__
+#define __OFFLINE_H__
+
+#include <stdint.h>
+
+/*
+ * Offline modes
+ *
+ * Dump the NAND to a file on the Pi's own storage, or flash an image from
+ * one, without a host on the serial port. The image has the same raw
+ * layout J-Runner writes: 0x200 data bytes and 0x10 spare bytes per sector.
+ * The caller stops the SMC first, as the console must not access the NAND
+ * meanwhile.
+ */
+
+/**
+ * Dump sectors 0 to sectors into a file
+ * The file is preallocated and mapped, sectors are read straight into the
+ * mapping and a second thread hashes finished erase blocks. The XXH64 of
+ * every erase block (see nand_hash.h) is written to path.xxh64, one
+ * "block hash" line each. Sectors that fail to read are left zeroed and
+ * listed in the log.
+ * @param path Output file, replaced if it exists
+ * @param sectors Number of sectors to dump
+ * @param running Cleared by the signal handler to cancel
+ * @return 0 on success, -1 on failure, read errors or cancellation
+ */
+int offline_dump(const char *path, uint32_t sectors, volatile int *running);
+
+/**
+ * Flash an image file
+ * The file is mapped read-only. Erase blocks that already match the image
+ * are skipped, the others are written through the write-back path, so each
+ * block is erased once and erasing and programming one block overlaps with
+ * queueing the next. With verify, written blocks are then re-read and
+ * compared by hash. A map with one character per erase block is printed at
+ * the end.
+ * @param path Raw image, a multiple of 0x210 bytes and no larger than the NAND
+ * @param verify Non-zero to verify written blocks
+ * @param running Cleared by the signal handler to cancel
+ * @return 0 on success, -1 on failure, mismatches or cancellation
+ */
+int offline_flash(const char *path, int verify, volatile int *running);
+
+#endif /* __OFFLINE_H__ */
@@ -18,6 +18,20 @@
 #define READ_FLASH 0x02
 #define WRITE_FLASH 0x03
 #define READ_FLASH_STREAM 0x04
+#define SYNC_FLASH 0x05
+#define DELTA_MANIFEST 0x06
+#define VERIFY_FLASH 0x07
+#define SCAN_SPARE 0x08
+#define READ_FLASH_STREAM_EX 0x09
+#define SET_STREAM_CODEC 0x0A
+#define LOAD_KNOWN_SECTORS 0x0B
+#define READ_FLASH_ESSENTIALS 0x0C
+#define ENTER_FRAMED_MODE 0x0D
+#define GET_CAPABILITIES 0x0E
+#define SET_TAGGED_MODE 0x0F
+#define STREAM_CREDIT 0x10
+#define STREAM_ABORT 0x11
+#define WRITE_FLASH_DATA 0x12
 
 #define EMMC_DETECT 0x50
 #define EMMC_INIT 0x51
@@ -48,8 +62,305 @@ struct cmd {
 };
 #pragma pack(pop)
 
+/*
+ * Block hash manifest (DELTA_MANIFEST)
+ * cmd.lba is the first erase block. The command is followed by a uint32
+ * block count and one XXH64 block hash per erase block (see nand_hash.h).
+ * Reply: uint32 status, uint32 number of differing blocks, then the
+ * differing erase block numbers as uint32.
+ *
+ * Verify after write (VERIFY_FLASH)
+ * cmd.lba is the first sector. The command is followed by a uint32 sector
+ * count and one XXH64 hash per erase block the range touches, covering only
+ * the sectors of the range inside that block. Buffered writes are committed
+ * first; the reply has the same layout, with the status of that commit.
+ *
+ * A range past the end of the NAND or of more than MANIFEST_MAX_BLOCKS
+ * blocks is answered with status 0x8000 and no blocks. The device reads and
+ * drops the hashes first, so the host sends them as usual.
+ */
+#define MANIFEST_MAX_BLOCKS 0x10000
+
+/*
+ * Data-only write (WRITE_FLASH_DATA)
+ * Same as WRITE_FLASH, but only the 0x200 data bytes follow the command.
+ * The device builds the spare area of a good block holding the block number
+ * and computes the EDC (see nand_edc.h), like adding ECC to an image on the
+ * host. Filesystem metadata in the spare is not preserved, so this suits
+ * images that carry none, such as the bootloader and system areas.
+ */
+
+/*
+ * Spare area scan (SCAN_SPARE)
+ * cmd.lba is the first sector. The command is followed by a uint32 sector
+ * count and a uint32 mode. Reply: uint32 status, then
+ *  SPARE_SCAN_FULL:       16 spare bytes per sector
+ *  SPARE_SCAN_BAD_BLOCKS: one SPARE_FLAG_* byte per erase block touched,
+ *                         checked from the block's first page
+ * followed by a uint32 count of sectors that failed to read and their lbas
+ * (only the first 64 are listed, the count covers all of them). Unreadable
+ * spare areas are reported as 0xFF. The range is cut at the end of the NAND;
+ * a first sector past the end is answered with status 0x8000 alone.
+ */
+#define SPARE_SCAN_FULL 0
+#define SPARE_SCAN_BAD_BLOCKS 1
+
+#define SPARE_FLAG_BAD 0x01
+#define SPARE_FLAG_READ_ERROR 0x02
+
+/*
+ * Streams (READ_FLASH_STREAM, READ_FLASH_STREAM_EX)
+ * Every sector produces a frame that starts with a uint32 frame word. The
+ * low 16 bits are the status: 0, or 0x8000 | NAND status on a read error,
+ * which also ends the stream. The upper bits are STREAM_FRAME_* flags. A
+ * frame word of 0 is followed by 0x210 bytes of data and spare.
+ *
+ * READ_FLASH_STREAM streams sectors 0 to cmd.lba with no options.
+ * READ_FLASH_STREAM_EX streams from sector cmd.lba and is followed by a
+ * struct stream_request selecting the end sector and STREAM_FLAG_* options.
+ *
+ * STREAM_FLAG_CONSENSUS reads every sector several times and sends the
+ * bitwise majority; a frame word of STREAM_FRAME_UNSTABLE instead of 0 marks
+ * a sector whose reads disagreed. Unstable sectors are never sent as erased
+ * or known markers.
+ *
+ * STREAM_FLAG_CRC appends a uint32 CRC32C of the 0x210 payload bytes to every
+ * frame that carries one, so the host can re-read only corrupted sectors.
+ *
+ * STREAM_FLAG_CREDIT sends a frame only while the host has granted credit:
+ * the stream starts with none and STREAM_CREDIT adds cmd.lba frames, with no
+ * reply. Every sector frame, marker frames included, uses one credit. A
+ * compressed stream sends its partial batch when the credit runs out.
+ *
+ * STREAM_FLAG_REMAP makes READ_FLASH_STREAM_EX stream the logical image with
+ * bad blocks replaced by their reserve blocks. The end sector is the size of
+ * the physical image area, a multiple of the erase block size; the stream
+ * stops before its last NAND_LAYOUT_RESERVE_BLOCKS erase blocks (nand_layout.h)
+ * and every frame read from a replacement block has STREAM_FRAME_REMAPPED
+ * set. READ_FLASH_ESSENTIALS ignores the flag.
+ *
+ * STREAM_FLAG_EDC checks the EDC (nand_edc.h) of every sector read that is
+ * not all 0xFF; a sector whose stored EDC does not match its contents has
+ * STREAM_FRAME_EDC_ERROR set in its frame word, whatever the frame type, so
+ * the host can re-read it right away.
+ *
+ * STREAM_ABORT stops the active stream before its next sector. Frames not
+ * yet handed to the wire are dropped, then a STREAM_FRAME_ABORTED frame word
+ * is sent, followed by the uint32 last sector sent (STREAM_NO_LBA if none).
+ * Without an active stream it reports the last sector of the previous one.
+ */
+#define STREAM_FLAG_ERASED 0x00000001   /* erased pages as marker frames */
+#define STREAM_FLAG_COMPRESS 0x00000002 /* frames batched and compressed */
+#define STREAM_FLAG_DEDUP 0x00000004    /* known sectors sent as hashes */
+#define STREAM_FLAG_CONSENSUS 0x00000008 /* majority of several reads */
+#define STREAM_FLAG_CRC 0x00000010      /* CRC32C after every sector payload */
+#define STREAM_FLAG_CREDIT 0x00000020   /* frames sent against host credit */
+#define STREAM_FLAG_REMAP 0x00000040    /* logical image, bad blocks remapped */
+#define STREAM_FLAG_EDC 0x00000080      /* sector EDC checked on the device */
+
+/* Reads per sector for STREAM_FLAG_CONSENSUS, 2-15, 0 selects 3 */
+#define STREAM_CONSENSUS_READS(flags) (((flags) >> 8) & 0xF)
+#define STREAM_CONSENSUS_MAX 15
+
+#define STREAM_FRAME_ERASED 0x00010000  /* page erased, no payload */
+#define STREAM_FRAME_BATCH 0x00020000   /* struct stream_batch follows */
+#define STREAM_FRAME_KNOWN 0x00040000   /* uint64 sector hash follows */
+#define STREAM_FRAME_UNSTABLE 0x00080000 /* reads disagreed, payload voted */
+#define STREAM_FRAME_ABORTED 0x00100000 /* uint32 last sector sent follows */
+#define STREAM_FRAME_REMAPPED 0x00200000 /* read from a replacement block */
+#define STREAM_FRAME_EDC_ERROR 0x00400000 /* stored EDC does not match */
+
+#define STREAM_NO_LBA 0xFFFFFFFF
+
+#pragma pack(push, 1)
+struct stream_request {
+    uint32_t end;       /* sector to stop before */
+    uint32_t flags;     /* STREAM_FLAG_* */
+};
+#pragma pack(pop)
+
+/*
+ * Essentials dump (READ_FLASH_ESSENTIALS)
+ * cmd.lba holds STREAM_FLAG_* options. The device parses the NAND header and
+ * replies with a uint32 status, a uint32 region count and that many
+ * struct essential_region. Offsets and lengths are bytes of the data-only
+ * image. Unless the status is non-zero, a stream follows covering every
+ * sector touched by a region exactly once, in ascending sector order.
+ */
+#define ESSENTIAL_HEADER 0
+#define ESSENTIAL_SMC 1
+#define ESSENTIAL_KEYVAULT 2
+#define ESSENTIAL_BOOTLOADER 3
+
+#pragma pack(push, 1)
+struct essential_region {
+    uint16_t type;      /* ESSENTIAL_* */
+    uint16_t magic;     /* bootloader magic, e.g. 0x4342 for CB */
+    uint32_t offset;
+    uint32_t length;
+};
+#pragma pack(pop)
+
+/*
+ * Known sectors (LOAD_KNOWN_SECTORS, STREAM_FLAG_DEDUP)
+ * cmd.lba is a hash count, followed by that many uint64 XXH64 hashes of
+ * sectors the host already has (0x210 bytes of data and spare each). A count
+ * of 0 clears the set. Reply: uint32 status.
+ * With STREAM_FLAG_DEDUP a sector whose hash is in the set is sent as a
+ * STREAM_FRAME_KNOWN frame word followed by only its hash.
+ */
+#define KNOWN_SECTORS_MAX 0x40000
+
+/*
+ * Stream compression (SET_STREAM_CODEC, STREAM_FLAG_COMPRESS)
+ * cmd.lba is a mask with bit (1 << STREAM_CODEC_*) set for every codec the
+ * host can decode. Reply: uint32 codec chosen for the rest of the session.
+ *
+ * With STREAM_FLAG_COMPRESS the per-sector frames of up to
+ * STREAM_BATCH_SECTORS sectors are concatenated and sent as one
+ * STREAM_FRAME_BATCH frame word, a struct stream_batch and comp_len payload
+ * bytes. The payload decompresses to exactly the frames an uncompressed
+ * stream would have sent, including a final error frame. A batch that does
+ * not shrink is sent with STREAM_CODEC_NONE.
+ *
+ * STREAM_CODEC_RLE: control byte c < 0x80 is followed by c + 1 literal
+ * bytes, c >= 0x80 by one byte repeated (c & 0x7F) + 3 times.
+ * STREAM_CODEC_LZ4: one LZ4 block (no frame header).
+ */
+#define STREAM_CODEC_NONE 0
+#define STREAM_CODEC_RLE 1
+#define STREAM_CODEC_LZ4 2
+
+#define STREAM_BATCH_SECTORS 32
+
+#pragma pack(push, 1)
+struct stream_batch {
+    uint16_t sectors;   /* sectors covered by this batch */
+    uint8_t codec;      /* STREAM_CODEC_* */
+    uint8_t reserved;
+    uint32_t raw_len;   /* length after decompression */
+    uint32_t comp_len;  /* payload bytes that follow */
+    uint32_t crc;       /* CRC32C of the decompressed frames */
+};
+#pragma pack(pop)
+
+/*
+ * Framed mode (ENTER_FRAMED_MODE)
+ * The device replies with a uint32 status on the current link, then both
+ * directions switch to frames: COBS-encoded, each terminated by a 0x00 byte.
+ * Decoded frame: uint8 type, uint8 reserved, uint16 sequence number, payload,
+ * uint32 CRC32C of everything before it.
+ *  LINK_FRAME_DATA:  up to LINK_MAX_PAYLOAD bytes of the normal byte stream;
+ *                    sequence numbers count up from 0 in each direction
+ *  LINK_FRAME_NAK:   no payload, asks for the data frame with that sequence
+ *                    number to be sent again
+ *  LINK_FRAME_CLOSE: host to device, return to the raw protocol; the device
+ *                    answers with a raw uint32 0
+ * The device sends NAKs for gaps and corrupted frames, and for the next
+ * expected frame when a command's data stalls for 0.5 s, dropping the command
+ * after 8 tries. It holds up to LINK_RX_WINDOW early frames and keeps its
+ * last LINK_HISTORY data frames for retransmission. The host should NAK the
+ * next expected frame if a reply stalls.
+ */
+#define LINK_FRAME_DATA 0x01
+#define LINK_FRAME_NAK 0x02
+#define LINK_FRAME_CLOSE 0x03
+
+#define LINK_MAX_PAYLOAD 1024
+#define LINK_HISTORY 256
+#define LINK_RX_WINDOW 8
+
+/*
+ * Capabilities (GET_CAPABILITIES)
+ * Reply: uint32 length, then that many bytes of struct capabilities. New
+ * fields are only ever appended, so hosts read the fields they know and skip
+ * the rest. GET_VERSION keeps returning PI4FLASHER_VERSION for J-Runner.
+ */
+#define CAP_WRITE_COALESCING 0x00000001 /* WRITE_FLASH buffered per erase block */
+#define CAP_SYNC 0x00000002             /* SYNC_FLASH */
+#define CAP_DELTA_MANIFEST 0x00000004   /* DELTA_MANIFEST, XXH64 block hashes */
+#define CAP_VERIFY 0x00000008           /* VERIFY_FLASH */
+#define CAP_SPARE_SCAN 0x00000010       /* SCAN_SPARE */
+#define CAP_STREAM_EX 0x00000020        /* READ_FLASH_STREAM_EX */
+#define CAP_KNOWN_SECTORS 0x00000040    /* LOAD_KNOWN_SECTORS */
+#define CAP_ESSENTIALS 0x00000080       /* READ_FLASH_ESSENTIALS */
+#define CAP_FRAMED 0x00000100           /* ENTER_FRAMED_MODE */
+#define CAP_TAGGED 0x00000200           /* SET_TAGGED_MODE, engine running */
+#define CAP_STREAM_ABORT 0x00000400     /* STREAM_ABORT, STREAM_CREDIT */
+#define CAP_WRITE_DATA 0x00000800       /* WRITE_FLASH_DATA */
+#define CAP_HW_CRC32C 0x00010000        /* CRC32C computed in hardware */
+
+#pragma pack(push, 1)
+struct capabilities {
+    uint16_t protocol;          /* PI4FLASHER_PROTOCOL_VERSION */
+    uint16_t reserved;
+    uint32_t features;          /* CAP_* */
+    uint32_t stream_flags;      /* STREAM_FLAG_* understood */
+    uint32_t codecs;            /* bit (1 << STREAM_CODEC_*) per codec */
+    uint16_t batch_sectors;     /* STREAM_BATCH_SECTORS */
+    uint16_t consensus_max;     /* STREAM_CONSENSUS_MAX */
+    uint16_t link_max_payload;  /* LINK_MAX_PAYLOAD */
+    uint16_t link_history;      /* LINK_HISTORY */
+    uint16_t link_rx_window;    /* LINK_RX_WINDOW */
+    uint16_t sector_size;       /* 0x200 data + 0x10 spare */
+    uint32_t manifest_max;      /* MANIFEST_MAX_BLOCKS */
+    uint32_t known_max;         /* KNOWN_SECTORS_MAX */
+    uint32_t flash_config;
+    uint32_t block_size;        /* erase block size in bytes */
+    uint16_t sectors_per_block;
+    uint8_t meta_type;          /* 0 small block, 1 big on small, 2 big block */
+    uint8_t reserved2;
+    uint16_t tagged_depth;      /* TAGGED_QUEUE_DEPTH */
+    uint16_t tagged_max_read;   /* TAGGED_MAX_READ */
+};
+#pragma pack(pop)
+
+/*
+ * Tagged mode (SET_TAGGED_MODE)
+ * cmd.lba 1 enters tagged mode; the reply is an untagged uint32 status,
+ * TAGGED_UNSUPPORTED if the engine thread is not running (no CAP_TAGGED).
+ * Each command is then a struct tagged_cmd followed by len payload bytes,
+ * and each reply a struct tagged_reply followed by len bytes: the body the
+ * command sends in untagged mode. A tagged SET_TAGGED_MODE with lba 0 waits
+ * for queued commands and returns to untagged mode.
+ *
+ * READ_FLASH, WRITE_FLASH, WRITE_FLASH_DATA and SYNC_FLASH are queued (up to
+ * TAGGED_QUEUE_DEPTH) and run in order on the engine thread. A tagged
+ * READ_FLASH may carry a uint32 sector count (1 to TAGGED_MAX_READ); the
+ * reply is the status followed by count sectors of 0x210 bytes, or the status
+ * alone on an error. GET_VERSION, GET_FLASH_CONFIG and GET_CAPABILITIES are
+ * answered immediately, ahead of queued work. Other commands, streams
+ * included, are answered with TAGGED_UNSUPPORTED.
+ */
+#define TAGGED_QUEUE_DEPTH 16
+#define TAGGED_MAX_PAYLOAD 0x400
+#define TAGGED_MAX_READ 64
+
+#define TAGGED_UNSUPPORTED 0x8001
+#define TAGGED_QUEUE_FULL 0x8002
+
+#pragma pack(push, 1)
+struct tagged_cmd {
+    uint8_t cmd;
+    uint8_t tag;
+    uint16_t reserved;
+    uint32_t lba;
+    uint32_t len;       /* payload bytes that follow */
+};
+
+struct tagged_reply {
+    uint8_t tag;
+    uint8_t cmd;
+    uint16_t reserved;
+    uint32_t len;       /* reply bytes that follow */
+};
+#pragma pack(pop)
+
 /* Version number */
 #define PI4FLASHER_VERSION 4
 
+/* Version of the extended protocol described by GET_CAPABILITIES */
+#define PI4FLASHER_PROTOCOL_VERSION 5
+
 #endif /* __PROTOCOL_H__ */
 
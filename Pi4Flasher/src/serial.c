@@ -0,0 +1,149 @@
+/*
+ * Pi4Flasher - Xbox 360 NAND Flasher for Raspberry Pi 4
+ * Copyright (c) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+#include "serial.h"
+#include "link.h"
+#include "log.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+/* Serial port file descriptor */
+static int serial_fd = -1;
+
+/* Keeps each write contiguous when the stream worker sends batches */
+static pthread_mutex_t serial_write_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int serial_init(const char *device, speed_t baud)
+{
+    struct termios tty;
+
+    serial_fd = open(device, O_RDWR | O_NOCTTY | O_SYNC);
+    if (serial_fd < 0) {
+        fprintf(stderr, "Error opening %s: %s\n", device, strerror(errno));
+        return -1;
+    }
+
+    /* Get current serial port settings */
+    if (tcgetattr(serial_fd, &tty) != 0) {
+        fprintf(stderr, "Error from tcgetattr: %s\n", strerror(errno));
+        close(serial_fd);
+        return -1;
+    }
+
+    /* Set baud rate */
+    cfsetospeed(&tty, baud);
+    cfsetispeed(&tty, baud);
+
+    /* 8N1 mode, no hardware flow control */
+    tty.c_cflag = (tty.c_cflag & ~CSIZE) | CS8;  /* 8-bit chars */
+    tty.c_iflag &= ~IGNBRK;                       /* disable break processing */
+    tty.c_lflag = 0;                              /* no signaling chars, no echo */
+    tty.c_oflag = 0;                              /* no remapping, no delays */
+    tty.c_cc[VMIN] = 0;                           /* read doesn't block */
+    tty.c_cc[VTIME] = 5;                          /* 0.5 seconds read timeout */
+
+    tty.c_iflag &= ~(IXON | IXOFF | IXANY);       /* shut off xon/xoff ctrl */
+    tty.c_cflag |= (CLOCAL | CREAD);              /* ignore modem controls, enable reading */
+    tty.c_cflag &= ~(PARENB | PARODD);            /* no parity */
+    tty.c_cflag &= ~CSTOPB;                       /* 1 stop bit */
+    tty.c_cflag &= ~CRTSCTS;                      /* no hardware flow control */
+
+    /* Apply settings */
+    if (tcsetattr(serial_fd, TCSANOW, &tty) != 0) {
+        fprintf(stderr, "Error from tcsetattr: %s\n", strerror(errno));
+        close(serial_fd);
+        return -1;
+    }
+
+    printf("Serial port %s opened successfully\n", device);
+    return 0;
+}
+
+int serial_read_exact(uint8_t *buffer, size_t len)
+{
+    size_t total = 0;
+
+    if (link_active())
+        return link_read_exact(buffer, len);
+    while (total < len) {
+        ssize_t n = read(serial_fd, buffer + total, len - total);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            LOG_ERROR("Serial read error: %s", strerror(errno));
+            return -1;
+        }
+        if (n == 0) {
+            /* Timeout or EOF */
+            if (total == 0)
+                return 0;  /* No data yet */
+            continue;  /* Keep trying */
+        }
+        total += n;
+    }
+    return total;
+}
+
+int serial_write(const uint8_t *buffer, size_t len)
+{
+    size_t total = 0;
+
+    if (link_active()) {
+        int ret = link_write(buffer, len);
+        if (ret != 0)
+            return ret;
+    }
+
+    pthread_mutex_lock(&serial_write_lock);
+    while (total < len) {
+        ssize_t n = write(serial_fd, buffer + total, len - total);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            LOG_ERROR("Serial write error: %s", strerror(errno));
+            pthread_mutex_unlock(&serial_write_lock);
+            return -1;
+        }
+        total += n;
+    }
+    pthread_mutex_unlock(&serial_write_lock);
+    return total;
+}
+
+void serial_discard(size_t len)
+{
+    uint8_t scratch[256];
+    while (len) {
+        size_t n = len < sizeof(scratch) ? len : sizeof(scratch);
+        if (serial_read_exact(scratch, n) != (int)n)
+            return;
+        len -= n;
+    }
+}
+
+int serial_pending(void)
+{
+    return link_active() && link_pending();
+}
+
+int serial_get_fd(void)
+{
+    return serial_fd;
+}
+
+void serial_close(void)
+{
+    if (serial_fd >= 0)
+        close(serial_fd);
+    serial_fd = -1;
+}
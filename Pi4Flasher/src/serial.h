@@ -0,0 +1,65 @@
+/*
+ * Pi4Flasher - Xbox 360 NAND Flasher for Raspberry Pi 4
+ * Copyright (c) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+#ifndef __SERIAL_H__
+#define __SERIAL_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <termios.h>
+
+/**
+ * Initialize serial port for communication with J-Runner
+ * @param device Serial device path (e.g., "/dev/ttyAMA0")
+ * @param baud Baud rate (e.g., B115200)
+ * @return 0 on success, -1 on failure
+ */
+int serial_init(const char *device, speed_t baud);
+
+/**
+ * Close the serial port
+ */
+void serial_close(void);
+
+/**
+ * Get the serial port file descriptor for select()
+ * @return File descriptor, -1 if not open
+ */
+int serial_get_fd(void);
+
+/**
+ * Check for received data that select() on the port cannot see
+ * @return non-zero if serial_read_exact() has data without reading the port
+ */
+int serial_pending(void);
+
+/**
+ * Read exactly len bytes from serial port (blocking with timeout)
+ * @param buffer Destination buffer
+ * @param len Number of bytes to read
+ * @return len on success, 0 if no data arrived, -1 on error
+ */
+int serial_read_exact(uint8_t *buffer, size_t len);
+
+/**
+ * Write data to serial port
+ * Safe to call from several threads; each call is written contiguously.
+ * @param buffer Source buffer
+ * @param len Number of bytes to write
+ * @return len on success, -1 on error
+ */
+int serial_write(const uint8_t *buffer, size_t len);
+
+/**
+ * Read and drop len bytes of a payload that cannot be processed
+ * @param len Number of bytes to drop
+ */
+void serial_discard(size_t len);
+
+#endif /* __SERIAL_H__ */
@@ -0,0 +1,505 @@
+/*
+ * Pi4Flasher - Xbox 360 NAND Flasher for Raspberry Pi 4
+ * Copyright (c) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+#include "stream.h"
+#include "protocol.h"
+#include "serial.h"
+#include "nand_wb.h"
+#include "codec.h"
+#include "dedup.h"
+#include "hash.h"
+#include "xbox.h"
+#include "dump_cache.h"
+#include "nand_edc.h"
+#include "log.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STREAM_FRAME_MAX (4 + 0x210 + 4)
+#define STREAM_BATCH_MAX (STREAM_BATCH_SECTORS * STREAM_FRAME_MAX)
+
+/* Frames of up to STREAM_BATCH_SECTORS sectors waiting to be compressed */
+struct stream_batch_buf {
+    uint8_t raw[STREAM_BATCH_MAX];
+    size_t len;
+    uint32_t sectors;
+    uint32_t codec;
+    uint32_t last;      /* sector of the last frame */
+};
+
+/* Stream mode state */
+static int do_stream = 0;
+static uint32_t stream_offset = 0;
+static uint32_t stream_end = 0;
+static struct nand_span stream_spans[NAND_LAYOUT_MAX_REGIONS];
+static uint32_t stream_span_count = 0;
+static uint32_t stream_span = 0;
+static uint32_t stream_flags = 0;
+static uint32_t stream_erased = 0;
+static uint32_t stream_known = 0;
+static uint32_t stream_reads = 1;       /* reads per sector */
+static uint32_t stream_unstable = 0;
+static uint32_t stream_codec = STREAM_CODEC_NONE;
+static uint32_t stream_credits = 0;     /* STREAM_FLAG_CREDIT frames left */
+static uint32_t stream_last = STREAM_NO_LBA;    /* last sector sent */
+static uint32_t stream_edc_errors = 0;
+
+/* STREAM_FLAG_REMAP: physical erase block of every logical block */
+static uint32_t *stream_remap;
+static uint32_t stream_remap_blocks;
+static uint32_t stream_remapped;
+
+/*
+ * Compressed streams: the command loop reads sectors into one batch while
+ * the worker compresses and sends the other, so compression runs on a
+ * second core and overlaps with NAND reads.
+ */
+static struct stream_batch_buf batches[2];
+static struct stream_batch_buf *batch_fill = &batches[0];  /* command loop */
+static struct stream_batch_buf *batch_busy;                 /* worker */
+static uint8_t batch_tx[4 + sizeof(struct stream_batch) + STREAM_BATCH_MAX];
+
+static pthread_t batch_thread;
+static int batch_thread_started;
+static pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t batch_cond = PTHREAD_COND_INITIALIZER;
+static int batch_stop;
+
+/* Statistics of the current stream, updated by the worker */
+static uint64_t stream_raw_bytes;
+static uint64_t stream_wire_bytes;
+
+static void stream_batch_send(struct stream_batch_buf *b)
+{
+    struct stream_batch hdr;
+    uint8_t *payload = &batch_tx[4 + sizeof(hdr)];
+    size_t len = codec_compress(b->codec, b->raw, b->len, payload, b->len - 1);
+
+    hdr.codec = b->codec;
+    if (!len) {
+        /* Incompressible, send the frames as they are */
+        memcpy(payload, b->raw, b->len);
+        len = b->len;
+        hdr.codec = STREAM_CODEC_NONE;
+    }
+    hdr.sectors = b->sectors;
+    hdr.reserved = 0;
+    hdr.raw_len = b->len;
+    hdr.comp_len = len;
+    hdr.crc = crc32c(b->raw, b->len);
+
+    uint32_t word = STREAM_FRAME_BATCH;
+    memcpy(batch_tx, &word, 4);
+    memcpy(&batch_tx[4], &hdr, sizeof(hdr));
+    serial_write(batch_tx, 4 + sizeof(hdr) + len);
+
+    stream_raw_bytes += b->len;
+    stream_wire_bytes += 4 + sizeof(hdr) + len;
+}
+
+static void *batch_thread_main(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&batch_lock);
+    for (;;) {
+        while (!batch_busy && !batch_stop)
+            pthread_cond_wait(&batch_cond, &batch_lock);
+        if (!batch_busy)
+            break;
+
+        struct stream_batch_buf *b = batch_busy;
+        pthread_mutex_unlock(&batch_lock);
+
+        stream_batch_send(b);
+
+        pthread_mutex_lock(&batch_lock);
+        b->len = 0;
+        b->sectors = 0;
+        batch_busy = NULL;
+        pthread_cond_broadcast(&batch_cond);
+    }
+    pthread_mutex_unlock(&batch_lock);
+    return NULL;
+}
+
+/* Called with batch_lock held */
+static void batch_wait_idle(void)
+{
+    while (batch_busy)
+        pthread_cond_wait(&batch_cond, &batch_lock);
+}
+
+/* Hand the fill batch to the worker and continue with the other one */
+static void batch_submit(void)
+{
+    pthread_mutex_lock(&batch_lock);
+    if (batch_fill->sectors) {
+        batch_wait_idle();
+        batch_fill->codec = stream_codec;
+        stream_last = batch_fill->last;
+        batch_busy = batch_fill;
+        batch_fill = batch_fill == &batches[0] ? &batches[1] : &batches[0];
+        pthread_cond_broadcast(&batch_cond);
+    }
+    pthread_mutex_unlock(&batch_lock);
+}
+
+/* Send one sector frame, directly or through the current batch */
+static void stream_emit(const void *frame, size_t len)
+{
+    if (!(stream_flags & STREAM_FLAG_COMPRESS)) {
+        serial_write(frame, len);
+        stream_last = stream_offset;
+        return;
+    }
+
+    memcpy(&batch_fill->raw[batch_fill->len], frame, len);
+    batch_fill->len += len;
+    batch_fill->last = stream_offset;
+    /* Out of credit, the host is waiting for the frames it granted */
+    if (++batch_fill->sectors == STREAM_BATCH_SECTORS ||
+        ((stream_flags & STREAM_FLAG_CREDIT) && stream_credits == 0))
+        batch_submit();
+}
+
+int stream_init(void)
+{
+    if (pthread_create(&batch_thread, NULL, batch_thread_main, NULL) != 0) {
+        LOG_ERROR("Failed to start stream compression thread");
+        return -1;
+    }
+    batch_thread_started = 1;
+    return 0;
+}
+
+void stream_deinit(void)
+{
+    free(stream_remap);
+    stream_remap = NULL;
+    stream_remap_blocks = 0;
+
+    if (!batch_thread_started)
+        return;
+
+    pthread_mutex_lock(&batch_lock);
+    batch_wait_idle();
+    batch_stop = 1;
+    pthread_cond_broadcast(&batch_cond);
+    pthread_mutex_unlock(&batch_lock);
+    pthread_join(batch_thread, NULL);
+    batch_thread_started = 0;
+}
+
+int stream_can_compress(void)
+{
+    return batch_thread_started;
+}
+
+uint32_t stream_set_codec(uint32_t mask)
+{
+    /* Without the worker every stream is sent raw */
+    if (!batch_thread_started)
+        mask = 1u << STREAM_CODEC_NONE;
+    stream_codec = codec_select(mask);
+    return stream_codec;
+}
+
+/**
+ * Build the remap table for a physical image area ending at sector end
+ * @return Logical end of the area, end itself if the table is unavailable
+ */
+static uint32_t stream_load_remap(uint32_t end, uint32_t *flags)
+{
+    uint32_t sectors = xbox_nand_get_geometry()->sectors_per_block;
+    uint32_t blocks = end / sectors;
+    uint32_t unrepaired;
+
+    *flags &= ~STREAM_FLAG_REMAP;
+    if (end % sectors || blocks <= NAND_LAYOUT_RESERVE_BLOCKS) {
+        LOG_WARN("Stream: cannot remap an area of %u sectors", end);
+        return end;
+    }
+
+    uint32_t logical = blocks - NAND_LAYOUT_RESERVE_BLOCKS;
+    if (logical > stream_remap_blocks) {
+        uint32_t *map = realloc(stream_remap, logical * sizeof(*map));
+        if (!map) {
+            LOG_ERROR("Stream: out of memory for the remap table");
+            return end;
+        }
+        stream_remap = map;
+        stream_remap_blocks = logical;
+    }
+
+    nand_wb_flush();
+    uint32_t remapped = nand_layout_remap(blocks, stream_remap, &unrepaired);
+    LOG_INFO("Stream: %u bad blocks remapped, %u without replacement",
+             remapped, unrepaired);
+    *flags |= STREAM_FLAG_REMAP;
+    return logical * sectors;
+}
+
+static void stream_begin(const struct nand_span *spans, uint32_t count, uint32_t flags);
+
+void stream_start(uint32_t start, uint32_t end, uint32_t flags)
+{
+    if (flags & STREAM_FLAG_REMAP)
+        end = stream_load_remap(end, &flags);
+
+    struct nand_span span = { start, end };
+    stream_begin(&span, 1, flags);
+}
+
+void stream_start_spans(const struct nand_span *spans, uint32_t count, uint32_t flags)
+{
+    /* Spans are physical sector runs */
+    stream_begin(spans, count, flags & ~STREAM_FLAG_REMAP);
+}
+
+static void stream_begin(const struct nand_span *spans, uint32_t count, uint32_t flags)
+{
+    if ((flags & STREAM_FLAG_COMPRESS) && !batch_thread_started) {
+        LOG_WARN("Stream: compression unavailable, sending raw frames");
+        flags &= ~STREAM_FLAG_COMPRESS;
+    }
+
+    stream_reads = 1;
+    if (flags & STREAM_FLAG_CONSENSUS) {
+        stream_reads = STREAM_CONSENSUS_READS(flags);
+        if (stream_reads == 0)
+            stream_reads = 3;
+        else if (stream_reads < 2)
+            stream_reads = 2;
+    }
+
+    if (count > NAND_LAYOUT_MAX_REGIONS)
+        count = NAND_LAYOUT_MAX_REGIONS;
+    memcpy(stream_spans, spans, count * sizeof(*spans));
+    stream_span_count = count;
+    stream_span = 0;
+
+    do_stream = count != 0;
+    stream_offset = count ? spans[0].start : 0;
+    stream_end = count ? spans[0].end : 0;
+    stream_flags = flags;
+    stream_erased = 0;
+    stream_known = 0;
+    stream_unstable = 0;
+    stream_credits = 0;
+    stream_last = STREAM_NO_LBA;
+    stream_remapped = 0;
+    stream_edc_errors = 0;
+    stream_raw_bytes = 0;
+    stream_wire_bytes = 0;
+}
+
+int stream_active(void)
+{
+    return do_stream;
+}
+
+int stream_ready(void)
+{
+    return do_stream && (!(stream_flags & STREAM_FLAG_CREDIT) || stream_credits);
+}
+
+void stream_grant(uint32_t frames)
+{
+    if (!do_stream)
+        return;
+    stream_credits = frames > UINT32_MAX - stream_credits ? UINT32_MAX :
+                     stream_credits + frames;
+}
+
+static void stream_finish(void)
+{
+    do_stream = 0;
+    if (stream_flags & STREAM_FLAG_COMPRESS) {
+        batch_submit();
+        pthread_mutex_lock(&batch_lock);
+        batch_wait_idle();
+        pthread_mutex_unlock(&batch_lock);
+        if (stream_wire_bytes)
+            LOG_INFO("Stream: %llu bytes sent as %llu (%.1f%%)",
+                     (unsigned long long)stream_raw_bytes,
+                     (unsigned long long)stream_wire_bytes,
+                     100.0 * stream_wire_bytes / stream_raw_bytes);
+    }
+    if (stream_flags & STREAM_FLAG_ERASED)
+        LOG_INFO("Stream: %u erased pages sent as markers", stream_erased);
+    if (stream_flags & STREAM_FLAG_DEDUP)
+        LOG_INFO("Stream: %u known sectors sent as hashes", stream_known);
+    if (stream_flags & STREAM_FLAG_CONSENSUS)
+        LOG_INFO("Stream: %u reads per sector, %u unstable sectors",
+                 stream_reads, stream_unstable);
+    if (stream_flags & STREAM_FLAG_REMAP)
+        LOG_INFO("Stream: %u sectors read from replacement blocks", stream_remapped);
+    if (stream_flags & STREAM_FLAG_EDC)
+        LOG_INFO("Stream: %u sectors failed the EDC check", stream_edc_errors);
+    xbox_nand_timing_report();
+}
+
+uint32_t stream_abort(void)
+{
+    if (do_stream) {
+        if (stream_flags & STREAM_FLAG_COMPRESS) {
+            /* Drop the frames still being collected, the batch the worker
+             * has is already on its way */
+            batch_fill->len = 0;
+            batch_fill->sectors = 0;
+        }
+        stream_finish();
+        LOG_INFO("Stream: aborted by host at block %u", stream_offset);
+    }
+
+    uint32_t frame[2] = { STREAM_FRAME_ABORTED, stream_last };
+    serial_write((uint8_t *)frame, sizeof(frame));
+    return stream_last;
+}
+
+/**
+ * Read a sector stream_reads times and vote bitwise on the result
+ * With two reads, or when every read matches, the first read is used.
+ * Ties of an even read count resolve to 0.
+ * @return 0 on success, NAND error code of the first failing read otherwise
+ */
+static uint32_t stream_read_consensus(uint32_t lba, uint8_t *sector, int *unstable)
+{
+    static uint8_t reads[STREAM_CONSENSUS_MAX][0x210];
+    uint32_t n = stream_reads;
+
+    *unstable = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t ret = xbox_nand_read_block(lba, reads[i], &reads[i][0x200]);
+        if (ret)
+            return ret;
+        if (i && memcmp(reads[i], reads[0], 0x210) != 0)
+            *unstable = 1;
+    }
+
+    if (!*unstable || n < 3) {
+        memcpy(sector, reads[0], 0x210);
+        return 0;
+    }
+
+    for (int b = 0; b < 0x210; b++) {
+        uint8_t out = 0;
+        for (int bit = 0; bit < 8; bit++) {
+            uint32_t ones = 0;
+            for (uint32_t i = 0; i < n; i++)
+                ones += (reads[i][b] >> bit) & 1;
+            if (ones * 2 > n)
+                out |= 1 << bit;
+        }
+        sector[b] = out;
+    }
+    return 0;
+}
+
+void stream_step(void)
+{
+    if (!do_stream)
+        return;
+
+    if (stream_offset >= stream_end) {
+        stream_finish();
+        return;
+    }
+    if (stream_flags & STREAM_FLAG_CREDIT) {
+        if (!stream_credits)
+            return;
+        stream_credits--;
+    }
+
+    uint8_t buffer[STREAM_FRAME_MAX];
+    uint32_t ret;
+    uint32_t lba = stream_offset;       /* physical sector */
+    uint32_t frame_flags = 0;           /* STREAM_FRAME_* of this sector */
+    int erased = 0;
+    int unstable = 0;
+
+    if (stream_flags & STREAM_FLAG_REMAP) {
+        uint32_t sectors = xbox_nand_get_geometry()->sectors_per_block;
+        uint32_t block = stream_offset / sectors;
+        if (stream_remap[block] != block) {
+            lba = stream_remap[block] * sectors + stream_offset % sectors;
+            frame_flags = STREAM_FRAME_REMAPPED;
+            stream_remapped++;
+        }
+    }
+
+    nand_wb_flush();
+
+    if (stream_flags & STREAM_FLAG_CONSENSUS) {
+        ret = stream_read_consensus(lba, &buffer[4], &unstable);
+        erased = !ret && !unstable && (stream_flags & STREAM_FLAG_ERASED) &&
+                 xbox_buffer_is_blank(&buffer[4], 0x210);
+    } else if (stream_flags & STREAM_FLAG_ERASED)
+        ret = xbox_nand_read_block_check_erased(lba, &buffer[4], &buffer[4 + 0x200], &erased);
+    else
+        ret = dump_cache_read(lba, &buffer[4], &buffer[4 + 0x200]);
+
+    if (ret != 0) {
+        stream_emit(&ret, 4);
+        LOG_WARN("Stream: read of block %u failed: 0x%X", lba, ret);
+        stream_finish();
+        return;
+    }
+
+    /* Erased pages carry no EDC */
+    if ((stream_flags & STREAM_FLAG_EDC) && !erased &&
+        !xbox_buffer_is_blank(&buffer[4], 0x210) && !nand_edc_check(&buffer[4])) {
+        frame_flags |= STREAM_FRAME_EDC_ERROR;
+        stream_edc_errors++;
+        LOG_WARN("Stream: block %u fails the EDC check", lba);
+    }
+
+    uint64_t hash = 0;
+    int known = !erased && !unstable && (stream_flags & STREAM_FLAG_DEDUP) &&
+                dedup_contains(hash = xxh64(&buffer[4], 0x210));
+
+    if (erased) {
+        uint32_t word = STREAM_FRAME_ERASED | frame_flags;
+        stream_emit(&word, 4);
+        stream_erased++;
+    } else if (known) {
+        uint32_t word = STREAM_FRAME_KNOWN | frame_flags;
+        memcpy(buffer, &word, 4);
+        memcpy(&buffer[4], &hash, 8);
+        stream_emit(buffer, 12);
+        stream_known++;
+    } else {
+        size_t len = 4 + 0x210;
+        *(uint32_t *)buffer = (unstable ? STREAM_FRAME_UNSTABLE : 0) | frame_flags;
+        if (stream_flags & STREAM_FLAG_CRC) {
+            uint32_t crc = crc32c(&buffer[4], 0x210);
+            memcpy(&buffer[len], &crc, 4);
+            len += 4;
+        }
+        stream_emit(buffer, len);
+    }
+    if (unstable) {
+        stream_unstable++;
+        LOG_DEBUG("Stream: block %u differs between reads", lba);
+    }
+
+    if (++stream_offset < stream_end)
+        return;
+
+    /* Continue with the next run, or finish right away so the last batch
+     * goes out before the next command */
+    if (++stream_span < stream_span_count) {
+        stream_offset = stream_spans[stream_span].start;
+        stream_end = stream_spans[stream_span].end;
+    } else {
+        stream_finish();
+    }
+}
@@ -0,0 +1,100 @@
+/*
+ * Pi4Flasher - Xbox 360 NAND Flasher for Raspberry Pi 4
+ * Copyright (c) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+#ifndef __STREAM_H__
+#define __STREAM_H__
+
+#include <stdint.h>
+#include "nand_layout.h"
+
+/*
+ * Bulk read streaming
+ *
+ * A stream sends one frame per sector from the command loop, one sector per
+ * stream_step() call, so commands from the host can still be serviced
+ * between sectors. Frame layout is described in protocol.h.
+ *
+ * Compressed streams collect the frames of STREAM_BATCH_SECTORS sectors and
+ * hand them to a worker thread, which compresses and sends the batch while
+ * the command loop reads the next one.
+ *
+ * With STREAM_FLAG_CREDIT a frame is only sent against credit granted by the
+ * host, and STREAM_ABORT ends a stream between two sectors.
+ */
+
+/**
+ * Start the stream compression worker
+ * @return 0 on success, -1 on failure
+ */
+int stream_init(void);
+
+/**
+ * Wait for the last batch to be sent and stop the worker
+ */
+void stream_deinit(void);
+
+/**
+ * Check whether compressed streams are available
+ * @return non-zero if the compression worker is running
+ */
+int stream_can_compress(void);
+
+/**
+ * Choose the codec for compressed streams of this session
+ * @param mask Bit (1 << STREAM_CODEC_*) set for every codec the host supports
+ * @return STREAM_CODEC_* id that will be used
+ */
+uint32_t stream_set_codec(uint32_t mask);
+
+/**
+ * Start streaming a sector range
+ * @param start First logical block address
+ * @param end Logical block address to stop before
+ * @param flags STREAM_FLAG_* options
+ */
+void stream_start(uint32_t start, uint32_t end, uint32_t flags);
+
+/**
+ * Start streaming several sector runs back to back
+ * @param spans Ascending, non-overlapping runs (copied)
+ * @param count Number of runs, at most NAND_LAYOUT_MAX_REGIONS
+ * @param flags STREAM_FLAG_* options
+ */
+void stream_start_spans(const struct nand_span *spans, uint32_t count, uint32_t flags);
+
+/**
+ * Check whether a stream is in progress
+ * @return non-zero while frames remain to be sent
+ */
+int stream_active(void);
+
+/**
+ * Check whether the active stream can send a frame now
+ * @return non-zero while a stream is active and not waiting for credit
+ */
+int stream_ready(void);
+
+/**
+ * Grant the active stream more frames (STREAM_CREDIT)
+ * @param frames Number of sector frames the host can accept
+ */
+void stream_grant(uint32_t frames);
+
+/**
+ * Stop the active stream and send the STREAM_FRAME_ABORTED frame
+ * @return Last sector sent, STREAM_NO_LBA if none
+ */
+uint32_t stream_abort(void);
+
+/**
+ * Send the next frame of the active stream
+ */
+void stream_step(void);
+
+#endif /* __STREAM_H__ */
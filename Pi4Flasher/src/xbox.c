@@ -11,8 +11,13 @@
 #include "pi4_gpio.h"
 #include "pins.h"
 #include "spiex.h"
+#include "log.h"
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <string.h>
 
 /* Sleep wrapper to match Pico SDK sleep_ms() */
 static inline void sleep_ms(uint32_t ms)
@@ -85,6 +90,92 @@ uint32_t xbox_get_flash_config(void)
     return flash_config;
 }
 
+const struct xbox_nand_geometry *xbox_nand_get_geometry(void)
+{
+    static struct xbox_nand_geometry geometry;
+    if (!geometry.block_size) {
+        uint32_t flash_config = xbox_get_flash_config();
+
+        int major = (flash_config >> 17) & 3;
+        int minor = (flash_config >> 4) & 3;
+
+        geometry.block_size = 0x4000;
+        if (major >= 1) {
+            if (minor == 2)
+                geometry.block_size = 0x20000;
+            else if (minor == 3)
+                geometry.block_size = 0x40000;
+        }
+        geometry.sectors_per_block = geometry.block_size / 0x200;
+
+        /* Size as decoded by libxenon's sfcx driver */
+        uint64_t bytes;
+        if (major == 0)
+            bytes = 0x800000ull << minor;
+        else if (minor >= 2)
+            bytes = 1ull << (((flash_config >> 19) & 3) + ((flash_config >> 21) & 0xF) + 23);
+        else if (major == 1)
+            bytes = minor ? 0x1000000 : 0x800000;
+        else
+            bytes = minor ? 0x4000000 : 0x1000000;
+        geometry.sectors = bytes / 0x200;
+
+        if (major == 0)
+            geometry.meta_type = XBOX_META_SMALL_BLOCK;
+        else if (minor < 2)
+            geometry.meta_type = XBOX_META_BIG_ON_SMALL;
+        else
+            geometry.meta_type = XBOX_META_BIG_BLOCK;
+    }
+    return &geometry;
+}
+
+int xbox_spare_is_bad(const uint8_t *spare)
+{
+    if (xbox_nand_get_geometry()->meta_type == XBOX_META_BIG_BLOCK)
+        return spare[0] != 0xFF;
+    return spare[5] != 0xFF;
+}
+
+uint32_t xbox_spare_block_id(const uint8_t *spare)
+{
+    if (xbox_nand_get_geometry()->meta_type == XBOX_META_SMALL_BLOCK)
+        return ((spare[1] & 0x0F) << 8) | spare[0];
+    return ((spare[2] & 0x0F) << 8) | spare[1];
+}
+
+int xbox_buffer_is_blank(const uint8_t *buf, uint32_t len)
+{
+    const uint32_t *words = (const uint32_t *)buf;
+    for (uint32_t i = 0; i < len / 4; i++) {
+        if (words[i] != 0xFFFFFFFF)
+            return 0;
+    }
+    return 1;
+}
+
+void xbox_spare_init(uint8_t *spare, uint32_t block)
+{
+    memset(spare, 0, 0x10);
+    switch (xbox_nand_get_geometry()->meta_type) {
+        case XBOX_META_SMALL_BLOCK:
+            spare[0] = block & 0xFF;
+            spare[1] = (block >> 8) & 0x0F;
+            spare[5] = 0xFF;
+            break;
+        case XBOX_META_BIG_ON_SMALL:
+            spare[1] = block & 0xFF;
+            spare[2] = (block >> 8) & 0x0F;
+            spare[5] = 0xFF;
+            break;
+        case XBOX_META_BIG_BLOCK:
+            spare[0] = 0xFF;
+            spare[1] = block & 0xFF;
+            spare[2] = (block >> 8) & 0x0F;
+            break;
+    }
+}
+
 uint16_t xbox_nand_get_status(void)
 {
     return spiex_read_reg(0x04);
@@ -95,17 +186,192 @@ void xbox_nand_clear_status(void)
     spiex_write_reg(0x04, spiex_read_reg(0x04));
 }
 
-int xbox_nand_wait_ready(uint16_t timeout)
+/*
+ * Adaptive ready-wait
+ *
+ * Each operation type keeps a running estimate of how long the NAND stays
+ * busy (tR, tPROG, tBERS). A wait sleeps through most of the expected
+ * window without touching the bus, then polls the status register at a
+ * fine interval until ready or until the wall-clock timeout expires.
+ * Waits run on the command, write-back and tagged engine threads, so the
+ * estimates and counters are only touched under wait_lock.
+ */
+struct nand_wait_model {
+    const char *name;
+    uint64_t expected_ns;   /* running estimate of busy time */
+    uint64_t timeout_ns;    /* give up after this long */
+    uint64_t ops;
+    uint64_t polls;
+    uint64_t busy_ns;
+};
+
+static struct nand_wait_model wait_models[XBOX_NAND_OP_COUNT] = {
+    [XBOX_NAND_OP_XFER]    = { "xfer",    0,        10000000 },
+    [XBOX_NAND_OP_READ]    = { "read",    50000,    10000000 },
+    [XBOX_NAND_OP_PROGRAM] = { "program", 300000,   50000000 },
+    [XBOX_NAND_OP_ERASE]   = { "erase",   2000000, 500000000 },
+};
+
+/* Running estimate of one status register read over SPI */
+static uint64_t poll_cost_ns = 5000;
+
+/* Running estimate of how late the scheduler wakes us from a sleep */
+static uint64_t sleep_overshoot_ns = 60000;
+
+static pthread_mutex_t wait_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Below this, sleeping costs more than it saves */
+#define WAIT_SLEEP_MIN_NS 100000
+#define WAIT_POLL_MIN_NS 2000
+#define WAIT_POLL_MAX_NS 200000
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleep_until_ns(uint64_t deadline)
+{
+    struct timespec ts = {
+        .tv_sec = deadline / 1000000000ull,
+        .tv_nsec = deadline % 1000000000ull,
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static void delay_ns(uint64_t ns)
+{
+    uint64_t deadline = now_ns() + ns;
+    if (ns >= WAIT_SLEEP_MIN_NS / 2) {
+        sleep_until_ns(deadline);
+        return;
+    }
+    while (now_ns() < deadline)
+        ;
+}
+
+int xbox_nand_wait_ready(enum xbox_nand_op op)
 {
-    do {
-        if (!(xbox_nand_get_status() & 0x01))
+    struct nand_wait_model *m = &wait_models[op];
+    uint64_t start = now_ns();
+    uint64_t polls = 0;
+    uint64_t poll_ns = 0;
+
+    pthread_mutex_lock(&wait_lock);
+    uint64_t expected = m->expected_ns;
+    uint64_t overshoot = sleep_overshoot_ns;
+    pthread_mutex_unlock(&wait_lock);
+    uint64_t deadline = start + m->timeout_ns;
+
+    /* Sleep through most of the expected busy window */
+    uint64_t quiet = expected - expected / 4;
+    if (quiet >= WAIT_SLEEP_MIN_NS + overshoot) {
+        uint64_t target = start + quiet - overshoot;
+        sleep_until_ns(target);
+        uint64_t late = now_ns() - target;
+        pthread_mutex_lock(&wait_lock);
+        sleep_overshoot_ns += ((int64_t)late - (int64_t)sleep_overshoot_ns) / 8;
+        pthread_mutex_unlock(&wait_lock);
+    }
+
+    uint64_t interval = expected / 16;
+    if (interval < WAIT_POLL_MIN_NS)
+        interval = WAIT_POLL_MIN_NS;
+    else if (interval > WAIT_POLL_MAX_NS)
+        interval = WAIT_POLL_MAX_NS;
+
+    for (;;) {
+        uint64_t before = now_ns();
+        uint16_t status = xbox_nand_get_status();
+        uint64_t after = now_ns();
+
+        polls++;
+        poll_ns += after - before;
+
+        if (!(status & 0x01)) {
+            uint64_t busy = after - start;
+
+            pthread_mutex_lock(&wait_lock);
+            poll_cost_ns += ((int64_t)(poll_ns / polls) - (int64_t)poll_cost_ns) / 16;
+            /*
+             * Ready on the first look only bounds the busy time from above;
+             * learning it would let sleep latency inflate the estimate.
+             */
+            if (polls == 1)
+                m->expected_ns -= m->expected_ns / 8;
+            else
+                m->expected_ns += ((int64_t)busy - (int64_t)m->expected_ns) / 8;
+            m->ops++;
+            m->polls += polls;
+            m->busy_ns += busy;
+            pthread_mutex_unlock(&wait_lock);
             return 0;
-    } while (timeout--);
+        }
 
+        if (after >= deadline)
+            break;
+        delay_ns(interval);
+    }
+
+    pthread_mutex_lock(&wait_lock);
+    m->polls += polls;
+    pthread_mutex_unlock(&wait_lock);
+    LOG_WARN("NAND %s timed out after %llu us (status 0x%04X)", m->name,
+             (unsigned long long)((now_ns() - start) / 1000), xbox_nand_get_status());
     return 1;
 }
 
-int xbox_nand_read_block(uint32_t lba, uint8_t *buffer, uint8_t *spare)
+uint64_t xbox_nand_expected_ns(enum xbox_nand_op op)
+{
+    pthread_mutex_lock(&wait_lock);
+    uint64_t ns = wait_models[op].expected_ns;
+    pthread_mutex_unlock(&wait_lock);
+    return ns;
+}
+
+void xbox_nand_timing_report(void)
+{
+    struct nand_wait_model models[XBOX_NAND_OP_COUNT];
+    uint64_t total_polls = 0;
+    uint64_t total_saved = 0;
+
+    pthread_mutex_lock(&wait_lock);
+    memcpy(models, wait_models, sizeof(models));
+    uint64_t cost = poll_cost_ns ? poll_cost_ns : 1;
+    pthread_mutex_unlock(&wait_lock);
+
+    for (int op = 0; op < XBOX_NAND_OP_COUNT; op++) {
+        struct nand_wait_model *m = &models[op];
+        if (!m->ops)
+            continue;
+
+        /* A blind spin would have polled back-to-back for the whole busy time */
+        uint64_t blind = m->busy_ns / cost + m->ops;
+        uint64_t saved = blind > m->polls ? blind - m->polls : 0;
+        total_polls += m->polls;
+        total_saved += saved;
+
+        LOG_INFO("NAND %s: %llu ops, avg %llu us busy, %.1f polls/op, %.1f polls/op saved",
+                 m->name, (unsigned long long)m->ops,
+                 (unsigned long long)(m->busy_ns / m->ops / 1000),
+                 (double)m->polls / m->ops, (double)saved / m->ops);
+    }
+
+    /* Every page read or program moves one sector; erases count against them */
+    uint64_t sectors = models[XBOX_NAND_OP_READ].ops + models[XBOX_NAND_OP_PROGRAM].ops;
+    if (sectors)
+        LOG_INFO("NAND: %llu sectors, %.1f polls/sector, %.1f polls/sector saved",
+                 (unsigned long long)sectors, (double)total_polls / sectors,
+                 (double)total_saved / sectors);
+}
+
+/**
+ * Load a page into the controller buffer
+ */
+static int nand_page_read(uint32_t lba)
 {
     xbox_nand_clear_status();
 
@@ -113,9 +379,34 @@ int xbox_nand_read_block(uint32_t lba, uint8_t *buffer, uint8_t *spare)
 
     spiex_write_reg(0x08, 0x03);
 
-    if (xbox_nand_wait_ready(0x1000))
+    if (xbox_nand_wait_ready(XBOX_NAND_OP_READ))
         return 0x8000 | xbox_nand_get_status();
 
+    return 0;
+}
+
+/**
+ * Read words from the controller buffer starting at a byte offset
+ */
+static void nand_buffer_read(uint32_t offset, uint8_t *dst, uint32_t len)
+{
+    spiex_write_reg(0x0C, offset);
+
+    uint8_t *end = dst + len;
+    while (dst < end) {
+        spiex_write_reg(0x08, 0x00);
+
+        *(uint32_t *)dst = spiex_read_reg(0x10);
+        dst += 4;
+    }
+}
+
+int xbox_nand_read_block(uint32_t lba, uint8_t *buffer, uint8_t *spare)
+{
+    int ret = nand_page_read(lba);
+    if (ret)
+        return ret;
+
     spiex_write_reg(0x0C, 0);
 
     uint8_t *end = buffer + 0x200;
@@ -137,6 +428,29 @@ int xbox_nand_read_block(uint32_t lba, uint8_t *buffer, uint8_t *spare)
     return 0;
 }
 
+int xbox_nand_read_spare(uint32_t lba, uint8_t *spare)
+{
+    int ret = nand_page_read(lba);
+    if (ret)
+        return ret;
+
+    nand_buffer_read(0x200, spare, 0x10);
+    return 0;
+}
+
+int xbox_nand_read_block_check_erased(uint32_t lba, uint8_t *buffer, uint8_t *spare,
+                                      int *erased)
+{
+    int ret = xbox_nand_read_spare(lba, spare);
+    if (ret)
+        return ret;
+
+    /* The page is still loaded, only the data words are left to fetch */
+    nand_buffer_read(0, buffer, 0x200);
+    *erased = xbox_buffer_is_blank(spare, 0x10) && xbox_buffer_is_blank(buffer, 0x200);
+    return 0;
+}
+
 int xbox_nand_erase_block(uint32_t lba)
 {
     xbox_nand_clear_status();
@@ -149,43 +463,21 @@ int xbox_nand_erase_block(uint32_t lba)
     spiex_write_reg(0x08, 0x55);
     spiex_write_reg(0x08, 0x05);
 
-    if (xbox_nand_wait_ready(0x1000))
+    if (xbox_nand_wait_ready(XBOX_NAND_OP_ERASE))
         return 0x8000 | xbox_nand_get_status();
 
     return 0;
 }
 
-int xbox_nand_write_block(uint32_t lba, uint8_t *buffer, uint8_t *spare)
+int xbox_nand_program_block(uint32_t lba, const uint8_t *buffer, const uint8_t *spare)
 {
-    int flash_config = xbox_get_flash_config();
-
-    int major = (flash_config >> 17) & 3;
-    int minor = (flash_config >> 4) & 3;
-
-    int blocksize = 0x4000;
-    if (major >= 1) {
-        if (minor == 2)
-            blocksize = 0x20000;
-        else if (minor == 3)
-            blocksize = 0x40000;
-    }
-
-    int sectors_in_block = blocksize / 0x200;
-
-    /* Erase block if this is the first sector */
-    if (lba % sectors_in_block == 0) {
-        int ret = xbox_nand_erase_block(lba);
-        if (ret)
-            return ret;
-    }
-
     xbox_nand_clear_status();
 
     spiex_write_reg(0x0C, 0);
 
-    uint8_t *end = buffer + 0x200;
+    const uint8_t *end = buffer + 0x200;
     while (buffer < end) {
-        spiex_write_reg(0x10, *(uint32_t *)buffer);
+        spiex_write_reg(0x10, *(const uint32_t *)buffer);
 
         spiex_write_reg(0x08, 0x01);
 
@@ -194,26 +486,26 @@ int xbox_nand_write_block(uint32_t lba, uint8_t *buffer, uint8_t *spare)
 
     end = spare + 0x10;
     while (spare < end) {
-        spiex_write_reg(0x10, *(uint32_t *)spare);
+        spiex_write_reg(0x10, *(const uint32_t *)spare);
 
         spiex_write_reg(0x08, 0x01);
 
         spare += 4;
     }
 
-    if (xbox_nand_wait_ready(0x1000))
+    if (xbox_nand_wait_ready(XBOX_NAND_OP_XFER))
         return 0x8000 | xbox_nand_get_status();
 
     spiex_write_reg(0x0C, lba << 9);
 
-    if (xbox_nand_wait_ready(0x1000))
+    if (xbox_nand_wait_ready(XBOX_NAND_OP_XFER))
         return 0x8000 | xbox_nand_get_status();
 
     spiex_write_reg(0x08, 0x55);
     spiex_write_reg(0x08, 0xAA);
     spiex_write_reg(0x08, 0x04);
 
-    if (xbox_nand_wait_ready(0x1000))
+    if (xbox_nand_wait_ready(XBOX_NAND_OP_PROGRAM))
         return 0x8000 | xbox_nand_get_status();
 
     return 0;
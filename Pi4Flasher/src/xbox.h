@@ -31,10 +31,65 @@ void xbox_stop_smc(void);
 
 /**
  * Get NAND flash configuration from register 0x00
+ * Read once and cached without a lock: the first call must come before
+ * other threads access the NAND.
  * @return 32-bit flash configuration value
  */
 uint32_t xbox_get_flash_config(void);
 
+/* Spare area layouts used by the different flash controllers */
+enum xbox_meta_type {
+    XBOX_META_SMALL_BLOCK,      /* small block controller */
+    XBOX_META_BIG_ON_SMALL,     /* big block controller, 16 KB blocks */
+    XBOX_META_BIG_BLOCK,        /* big block controller, 128/256 KB blocks */
+};
+
+/* Erase geometry decoded from the flash configuration */
+struct xbox_nand_geometry {
+    uint32_t block_size;        /* erase block size in data bytes */
+    uint32_t sectors_per_block; /* 512-byte sectors per erase block */
+    uint32_t sectors;           /* 512-byte sectors of the whole NAND */
+    enum xbox_meta_type meta_type;
+};
+
+/**
+ * Get the NAND erase geometry (decoded once and cached)
+ * Like xbox_get_flash_config(), first called before the worker threads start.
+ * @return Pointer to the cached geometry
+ */
+const struct xbox_nand_geometry *xbox_nand_get_geometry(void);
+
+/**
+ * Check the bad block marker of a spare area
+ * @param spare 16 bytes of spare data of a block's first or second page
+ * @return non-zero if the erase block is marked bad
+ */
+int xbox_spare_is_bad(const uint8_t *spare);
+
+/**
+ * Get the logical block number stored in a spare area
+ * @param spare 16 bytes of spare data of a block's first page
+ * @return 12-bit block number
+ */
+uint32_t xbox_spare_block_id(const uint8_t *spare);
+
+/**
+ * Check whether sector contents read back as erased NAND
+ * @param buf Data, spare or a whole 0x210-byte sector, 4-byte aligned
+ * @param len Length in bytes, a multiple of 4
+ * @return 1 if every byte is 0xFF, 0 otherwise
+ */
+int xbox_buffer_is_blank(const uint8_t *buf, uint32_t len);
+
+/**
+ * Build the spare area of a good block's sector, as image tools do
+ * Stores the block number and clears the bad block marker for the current
+ * layout; every other byte, the EDC included, is zeroed (see nand_edc.h).
+ * @param spare Receives 16 bytes of spare data
+ * @param block Logical block number
+ */
+void xbox_spare_init(uint8_t *spare, uint32_t block);
+
 /**
  * Get NAND status register
  * @return 16-bit status value
@@ -46,12 +101,36 @@ uint16_t xbox_nand_get_status(void);
  */
 void xbox_nand_clear_status(void);
 
+/* NAND operation types with separately learned busy times */
+enum xbox_nand_op {
+    XBOX_NAND_OP_XFER,      /* controller page buffer transfer */
+    XBOX_NAND_OP_READ,      /* page read (tR) */
+    XBOX_NAND_OP_PROGRAM,   /* page program (tPROG) */
+    XBOX_NAND_OP_ERASE,     /* block erase (tBERS) */
+    XBOX_NAND_OP_COUNT
+};
+
 /**
  * Wait for NAND to become ready
- * @param timeout Timeout counter
+ * Sleeps for most of the learned busy time of the operation, then polls
+ * the status register at a fine interval until a wall-clock timeout.
+ * @param op Operation that was just started
  * @return 0 if ready, non-zero if timeout
  */
-int xbox_nand_wait_ready(uint16_t timeout);
+int xbox_nand_wait_ready(enum xbox_nand_op op);
+
+/**
+ * Get the learned busy time of an operation
+ * @param op Operation type
+ * @return Current estimate in nanoseconds
+ */
+uint64_t xbox_nand_expected_ns(enum xbox_nand_op op);
+
+/**
+ * Log per-operation busy times and status polls saved versus blind polling,
+ * per operation and per sector read or programmed
+ */
+void xbox_nand_timing_report(void);
 
 /**
  * Read a block from NAND flash
@@ -62,6 +141,29 @@ int xbox_nand_wait_ready(uint16_t timeout);
  */
 int xbox_nand_read_block(uint32_t lba, uint8_t *buffer, uint8_t *spare);
 
+/**
+ * Read only the spare area of a block
+ * Loads the page, then jumps straight to the spare words through the
+ * offset register instead of clocking out the 512 data bytes.
+ * @param lba Logical block address (512-byte sector)
+ * @param spare Buffer for 16 bytes of spare/ECC data
+ * @return 0 on success, error code on failure
+ */
+int xbox_nand_read_spare(uint32_t lba, uint8_t *spare);
+
+/**
+ * Read a block and check whether its page is erased
+ * Every data and spare byte is read and checked, so a page reported erased
+ * really is all 0xFF and callers may send a marker in place of its data.
+ * @param lba Logical block address (512-byte sector)
+ * @param buffer Buffer for 512 bytes of data
+ * @param spare Buffer for 16 bytes of spare/ECC data
+ * @param erased Set to 1 if all 0x210 bytes are 0xFF, 0 otherwise
+ * @return 0 on success, error code on failure
+ */
+int xbox_nand_read_block_check_erased(uint32_t lba, uint8_t *buffer, uint8_t *spare,
+                                      int *erased);
+
 /**
  * Erase a block in NAND flash
  * @param lba Logical block address
@@ -70,13 +172,15 @@ int xbox_nand_read_block(uint32_t lba, uint8_t *buffer, uint8_t *spare);
 int xbox_nand_erase_block(uint32_t lba);
 
 /**
- * Write a block to NAND flash (automatically erases if needed)
+ * Program a block to NAND flash
+ * The containing erase block must already be erased; see nand_wb.h for the
+ * coalescing write path that takes care of erasing.
  * @param lba Logical block address
  * @param buffer 512 bytes of data to write
  * @param spare 16 bytes of spare/ECC data to write
  * @return 0 on success, error code on failure
  */
-int xbox_nand_write_block(uint32_t lba, uint8_t *buffer, uint8_t *spare);
+int xbox_nand_program_block(uint32_t lba, const uint8_t *buffer, const uint8_t *spare);
 
 #endif /* __XBOX_H__ */
 
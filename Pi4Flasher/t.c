@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "hash.h"
+#include "codec.h"
+#include "nand_edc.h"
+#include "protocol.h"
+static uint32_t ref_edc(const uint8_t *d){
+  uint32_t val=0,v=0;
+  for(int i=0;i<0x1066;i++){
+    if(!(i&31)){ uint32_t w; memcpy(&w,d+i/8,4); v=~w; }
+    val ^= v&1; v>>=1;
+    if(val&1) val^=0x6954559;
+    val>>=1;
+  }
+  return (~val) & 0x3FFFFFF;
+}
+static long lz4_dec(const uint8_t *s,size_t n,uint8_t *o,size_t cap){
+  size_t i=0,op=0;
+  while(i<n){ uint8_t t=s[i++]; size_t l=t>>4; if(l==15){uint8_t b; do{b=s[i++]; l+=b;}while(b==255);} 
+    if(op+l>cap) return -1; memcpy(o+op,s+i,l); op+=l; i+=l; if(i>=n) break;
+    size_t off=s[i]|(s[i+1]<<8); i+=2; size_t m=t&15; if(m==15){uint8_t b; do{b=s[i++]; m+=b;}while(b==255);} m+=4;
+    if(off==0||off>op) return -2; for(size_t k=0;k<m;k++){ o[op]=o[op-off]; op++;} }
+  return op;
+}
+static long rle_dec(const uint8_t *s,size_t n,uint8_t *o){ size_t i=0,op=0; while(i<n){uint8_t c=s[i++]; if(c<0x80){memcpy(o+op,s+i,c+1);op+=c+1;i+=c+1;} else {memset(o+op,s[i++],(c&0x7f)+3); op+=(c&0x7f)+3;}} return op;}
+int main(){
+  printf("xxh64('')=%016llx\n",(unsigned long long)xxh64("",0));
+  printf("xxh64(abc)=%016llx\n",(unsigned long long)xxh64("abc",3));
+  const char *s="Nobody inspects the spammish repetition";
+  printf("xxh64(nobody)=%016llx\n",(unsigned long long)xxh64(s,strlen(s)));
+  printf("crc32c=%08x hw=%d\n",crc32c("123456789",9),crc32c_hw());
+  srand(1); uint8_t buf[100000];
+  for(int i=0;i<sizeof buf;i++) buf[i]=rand();
+  /* streaming consistency */
+  for(int t=0;t<200;t++){ size_t n=rand()%5000; struct xxh64_state st; xxh64_init(&st); size_t p=0; while(p<n){size_t c=rand()%70; if(c>n-p)c=n-p; xxh64_update(&st,buf+p,c); p+=c;} if(xxh64_digest(&st)!=xxh64(buf,n)) {printf("stream mismatch\n");return 1;} }
+  /* edc */
+  int bad=0; for(int t=0;t<2000;t++){ uint8_t sec[0x210]; for(int i=0;i<0x210;i++) sec[i]= (t&1)? rand(): (rand()%4?0xFF:rand()); if(nand_edc_calc(sec)!=ref_edc(sec)) bad++; nand_edc_store(sec); if(!nand_edc_check(sec)) bad++; }
+  printf("edc bad=%d\n",bad);
+  /* codecs */
+  static uint8_t src[STREAM_BATCH_SECTORS*536], dst[STREAM_BATCH_SECTORS*536+64], out[STREAM_BATCH_SECTORS*536+64];
+  int fails=0, overrun=0;
+  for(int t=0;t<20000;t++){
+    size_t n=1+rand()%sizeof src; int mode=rand()%4;
+    for(size_t i=0;i<n;i++){ src[i]= mode==0? rand(): mode==1? (rand()%8? 0xFF: rand()) : mode==2? (uint8_t)(i/ (1+rand()%3) %7) : (rand()%3); }
+    if(rand()%3==0){ size_t cp=rand()%(n+1); size_t off=1+rand()%300; for(size_t i=off;i<cp&&i<n;i++) src[i]=src[i-off]; }
+    for(int codec=1;codec<=2;codec++){
+      size_t cap = n-1 ? n-1 : 0; if(rand()%2) cap = rand()%(n+1);
+      memset(dst,0xAB,sizeof dst);
+      size_t l=codec_compress(codec,src,n,dst,cap);
+      for(size_t k=cap;k<cap+40&&k<sizeof dst;k++) if(dst[k]!=0xAB){ overrun++; break;}
+      if(!l) continue;
+      if(l>cap){ overrun++; }
+      long d = codec==2? lz4_dec(dst,l,out,sizeof out): rle_dec(dst,l,out);
+      if(d!=(long)n || memcmp(out,src,n)) { fails++; }
+    }
+  }
+  printf("codec fails=%d overrun=%d\n",fails,overrun);
+}